@@ -0,0 +1,114 @@
+#include <atomic>
+#include <chrono>
+#include <iostream>
+
+#include "tcp_srv.hpp"
+#include "utils.hpp"
+
+#include "cxxopts.hpp"
+
+// connections/sec of tcp_srv with a single acceptor vs one SO_REUSEPORT listener per thread
+
+using asio::ip::tcp;
+
+namespace {
+
+std::atomic<uint64_t> accepted{0};
+
+class sink_session {
+public:
+    explicit sink_session(asio::io_context& ctx): socket_{ctx} {}
+
+    tcp::socket& socket() {
+        return socket_;
+    }
+
+    void start() {
+        accepted.fetch_add(1, std::memory_order_relaxed);
+        std::error_code ec;
+        socket_.close(ec);
+    }
+
+    void reset() {
+    }
+
+private:
+    tcp::socket socket_;
+};
+
+void hammer(uint16_t port, const std::atomic<bool>& running) {
+    asio::io_context ctx;
+    tcp::endpoint ep{asio::ip::address_v4::loopback(), port};
+    while (running.load(std::memory_order_relaxed)) {
+        tcp::socket sock{ctx};
+        std::error_code ec;
+        sock.connect(ep, ec);
+        if (ec) {
+            continue;
+        }
+        // RST instead of FIN so the client side does not run out of ports in TIME_WAIT
+        sock.set_option(tcp::socket::linger(true, 0), ec);
+        sock.close(ec);
+    }
+}
+
+double measure(size_t threads, bool reuse_port, size_t clients, int seconds) {
+    mole::tcp_srv<sink_session> srv{0, threads, false, reuse_port};
+    srv.start();
+
+    std::atomic<bool> running{true};
+    std::vector<std::thread> workers;
+    for (size_t i = 0; i < clients; ++i) {
+        workers.emplace_back(hammer, srv.port(), std::cref(running));
+    }
+
+    // warm up, then count
+    std::this_thread::sleep_for(std::chrono::milliseconds(200));
+    auto begin = accepted.load();
+    auto t0 = std::chrono::steady_clock::now();
+    std::this_thread::sleep_for(std::chrono::seconds(seconds));
+    auto end = accepted.load();
+    auto t1 = std::chrono::steady_clock::now();
+
+    running = false;
+    for (auto& w: workers) {
+        w.join();
+    }
+    srv.stop();
+
+    auto secs = std::chrono::duration<double>(t1 - t0).count();
+    return static_cast<double>(end - begin) / secs;
+}
+
+}
+
+int main(int argc, char** argv) {
+    cxxopts::Options options("mole_accept_bench", "tcp_srv accept rate");
+    options.add_options()("help", "show help");
+    options.add_options()("t,threads", "max server threads", cxxopts::value<size_t>()->default_value(
+        std::to_string(std::max(std::thread::hardware_concurrency(), 1u))), "threads");
+    options.add_options()("c,clients", "client threads", cxxopts::value<size_t>()->default_value("4"), "clients");
+    options.add_options()("s,seconds", "seconds per run", cxxopts::value<int>()->default_value("3"), "seconds");
+    auto args = options.parse(argc, argv);
+    if (args.count("help") > 0) {
+        std::cout << options.help({}) << std::endl;
+        return 0;
+    }
+
+    mole::logging_init("bench");
+    spdlog::set_level(spdlog::level::warn);
+
+    auto max_threads = args["threads"].as<size_t>();
+    auto clients = args["clients"].as<size_t>();
+    auto seconds = args["seconds"].as<int>();
+
+    std::cout << "mode        threads  conn/s" << std::endl;
+    for (auto reuse_port: {false, true}) {
+        for (size_t t = 1; t <= max_threads; t *= 2) {
+            auto cps = measure(t, reuse_port, clients, seconds);
+            std::cout << fmt::format("{:<10}  {:>7}  {:>8.0f}", reuse_port ? "reuse_port" : "acceptor", t, cps)
+                      << std::endl;
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,79 @@
+#include <sodium.h>
+
+#include <chrono>
+#include <iostream>
+
+#include "mole_crypto.hpp"
+#include "utils.hpp"
+
+#include "cxxopts.hpp"
+
+// per-frame cost of the old data path (XChaCha20-Poly1305, HChaCha20 subkey on every frame)
+// against mole_crypto (ChaCha20-Poly1305 IETF under a per-session subkey, counter nonces),
+// and AES-256-GCM where the cpu has AES-NI
+
+namespace {
+
+template<typename F>
+double ns_per_frame(size_t frames, F&& f) {
+    auto t0 = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < frames; ++i) {
+        f();
+    }
+    auto t1 = std::chrono::steady_clock::now();
+    return std::chrono::duration<double, std::nano>(t1 - t0).count() / static_cast<double>(frames);
+}
+
+}
+
+int main(int argc, char** argv) {
+    cxxopts::Options options("mole_crypto_bench", "per-frame AEAD cost");
+    options.add_options()("help", "show help");
+    options.add_options()("b,bytes", "bytes to process per frame size",
+        cxxopts::value<size_t>()->default_value("268435456"), "bytes");
+    auto args = options.parse(argc, argv);
+    if (args.count("help") > 0) {
+        std::cout << options.help({}) << std::endl;
+        return 0;
+    }
+    if (!mole::mole_crypto::init()) {
+        std::cerr << "crypto init failed" << std::endl;
+        return 1;
+    }
+    auto total = args["bytes"].as<size_t>();
+
+    auto key = mole::mole_crypto::make_key("bench");
+    std::vector<uint8_t> nonce(mole::mole_crypto::nonce_size());
+    randombytes_buf(nonce.data(), nonce.size());
+    auto bench_key = mole::mole_key::make("", "bench");
+    mole::mole_crypto crypto{bench_key, mole::mole_crypto::role::local};
+    mole::mole_crypto gcm{bench_key, mole::mole_crypto::role::local};
+    auto has_gcm = (mole::mole_crypto::available() & static_cast<uint8_t>(mole::mole_crypto::cipher::aes256_gcm)) != 0;
+    if (has_gcm) {
+        gcm.use(mole::mole_crypto::cipher::aes256_gcm);
+    }
+
+    std::cout << "    size   xchacha ns/frame   ietf ns/frame   speedup   gcm ns/frame   speedup" << std::endl;
+    for (size_t size: {64, 256, 1024, 1500, 4096, 16384, 32768}) {
+        std::vector<uint8_t> buff(size + mole::mole_crypto::extra_size());
+        randombytes_buf(buff.data(), size);
+        auto frames = std::max<size_t>(total / size, 1000);
+
+        auto before = ns_per_frame(frames, [&]() {
+            crypto_aead_xchacha20poly1305_ietf_encrypt(
+                buff.data(), nullptr, buff.data(), size, nullptr, 0, nullptr, nonce.data(), key.data());
+        });
+        auto after = ns_per_frame(frames, [&]() {
+            crypto.encrypt(buff.data(), size, buff.data());
+        });
+        std::cout << fmt::format("{:>8}  {:>17.1f}  {:>14.1f}  {:>7.2f}x", size, before, after, before / after);
+        if (has_gcm) {
+            auto aes = ns_per_frame(frames, [&]() {
+                gcm.encrypt(buff.data(), size, buff.data());
+            });
+            std::cout << fmt::format("  {:>13.1f}  {:>7.2f}x", aes, before / aes);
+        }
+        std::cout << std::endl;
+    }
+    return 0;
+}
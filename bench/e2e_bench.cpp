@@ -0,0 +1,798 @@
+#include <dirent.h>
+#include <malloc.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <thread>
+
+#include "buffer_pool.hpp"
+#include "dns_resolver.hpp"
+#include "handshake_stats.hpp"
+#include "key_manager.hpp"
+#include "local_session.hpp"
+#include "remote_session.hpp"
+#include "tcp_srv.hpp"
+#include "utils.hpp"
+
+#include "cxxopts.hpp"
+
+// The whole tunnel on loopback in one process: SOCKS5 clients -> tcp_srv<local_session> ->
+// tcp_srv<remote_session> -> echo target. Bulk echo for throughput, then small request/response
+// for latency. CPU is that of the whole process, clients and target included.
+// cps mode churns short connections that only do the handshake, and reports its phases as
+// seen by the client and by the sessions (handshake_stats). With --dns-standin the remote
+// resolves --domain through dns_resolver, answered by a stand-in nameserver in this process.
+// idle mode holds many connections open and reports what each one costs local and remote in
+// RSS, heap and fds; there the two run in child processes so their numbers are their own. What
+// the buffer and session pools keep idle is shown apart, not counted per connection.
+
+using asio::ip::tcp;
+
+namespace {
+
+using clock_type = std::chrono::steady_clock;
+
+class echo_session: public std::enable_shared_from_this<echo_session> {
+public:
+    explicit echo_session(asio::io_context& ctx): socket_{ctx} {}
+
+    tcp::socket& socket() {
+        return socket_;
+    }
+
+    void start() {
+        read();
+    }
+
+    void reset() {
+        std::error_code ec;
+        socket_.close(ec);
+    }
+
+private:
+    void read() {
+        auto self = shared_from_this();
+        socket_.async_read_some(asio::buffer(buff_), [this, self](const std::error_code& ec, size_t sz) {
+            if (ec) {
+                return;
+            }
+            asio::async_write(socket_, asio::buffer(buff_.data(), sz), [this, self](const std::error_code& ec, size_t) {
+                if (ec) {
+                    return;
+                }
+                read();
+            });
+        });
+    }
+
+    tcp::socket socket_;
+    std::array<uint8_t, 1024 * 16> buff_;
+};
+
+// nameserver answering every A query with 127.0.0.1 and every AAAA query with ::1
+class dns_standin {
+public:
+    dns_standin(asio::io_context& ctx, uint32_t ttl):
+        socket_{ctx, asio::ip::udp::endpoint{asio::ip::address_v4::loopback(), 0}}, ttl_{ttl}, queries_{0} {
+        receive();
+    }
+
+    asio::ip::udp::endpoint endpoint() const {
+        return socket_.local_endpoint();
+    }
+
+    size_t queries() const {
+        return queries_.load();
+    }
+
+private:
+    void receive() {
+        socket_.async_receive_from(asio::buffer(buff_), from_, [this](const std::error_code& ec, size_t sz) {
+            if (ec) {
+                return;
+            }
+            answer(sz);
+            receive();
+        });
+    }
+
+    void answer(size_t sz) {
+        // the question is sent back, whatever follows it in the query is not
+        size_t p = 12;
+        while (p < sz && buff_[p] != 0) {
+            p += 1 + buff_[p];
+        }
+        p += 1 + 4;
+        if (sz < 12 || p > sz) {
+            return;
+        }
+        auto type = static_cast<uint16_t>(buff_[p - 4] << 8u | buff_[p - 3]);
+        auto out = std::make_shared<std::vector<uint8_t>>(buff_.begin(), buff_.begin() + static_cast<std::ptrdiff_t>(p));
+        auto& o = *out;
+        // response, recursion desired and available, NOERROR, no other sections
+        o[2] = 0x81;
+        o[3] = 0x80;
+        std::fill(o.begin() + 6, o.begin() + 12, 0);
+        const uint8_t ttl[4] = {
+            static_cast<uint8_t>(ttl_ >> 24u), static_cast<uint8_t>(ttl_ >> 16u),
+            static_cast<uint8_t>(ttl_ >> 8u), static_cast<uint8_t>(ttl_),
+        };
+        if (type == mole::dns_resolver::TYPE_A || type == mole::dns_resolver::TYPE_AAAA) {
+            o[7] = 1;
+            // the name is a pointer to the question
+            o.insert(o.end(), {0xc0, 0x0c, static_cast<uint8_t>(type >> 8u), static_cast<uint8_t>(type), 0x00, 0x01});
+            o.insert(o.end(), ttl, ttl + 4);
+            if (type == mole::dns_resolver::TYPE_A) {
+                o.insert(o.end(), {0x00, 0x04, 127, 0, 0, 1});
+            } else {
+                auto ip = asio::ip::address_v6::loopback().to_bytes();
+                o.insert(o.end(), {0x00, 0x10});
+                o.insert(o.end(), ip.begin(), ip.end());
+            }
+        }
+        ++queries_;
+        socket_.async_send_to(asio::buffer(o), from_, [out](const std::error_code&, size_t) {});
+    }
+
+    asio::ip::udp::socket socket_;
+    asio::ip::udp::endpoint from_;
+    std::array<uint8_t, 512> buff_;
+    uint32_t ttl_;
+    std::atomic<size_t> queries_;
+};
+
+// SOCKS5 client through the tunnel to the echo target
+class client: public std::enable_shared_from_this<client> {
+public:
+    // phases of the handshake seen from the client
+    enum phase {
+        tcp_connect,
+        greeting,
+        request,
+        PHASES,
+    };
+
+    // with a domain the target is sent by name, the remote resolves it
+    client(asio::io_context& ctx, const tcp::endpoint& proxy, const tcp::endpoint& target, const std::string& domain):
+        socket_{ctx}, proxy_{proxy}, target_{target}, domain_{domain}, received_{0} {}
+
+    void handshake(std::function<void(bool)> done) {
+        done_ = std::move(done);
+        marks_[0] = clock_type::now();
+        auto self = shared_from_this();
+        socket_.async_connect(proxy_, [this, self](const std::error_code& ec) {
+            if (ec) {
+                return finish(false);
+            }
+            marks_[1] = clock_type::now();
+            socket_.set_option(tcp::no_delay(true));
+            static const uint8_t hello[3] = {0x05, 0x01, 0x00};
+            asio::async_write(socket_, asio::buffer(hello), [this, self](const std::error_code& ec, size_t) {
+                if (ec) {
+                    return finish(false);
+                }
+                asio::async_read(socket_, asio::buffer(reply_, 2), [this, self](const std::error_code& ec, size_t) {
+                    if (ec || reply_[1] != 0x00) {
+                        return finish(false);
+                    }
+                    marks_[2] = clock_type::now();
+                    command();
+                });
+            });
+        });
+    }
+
+    // microseconds spent in each phase of the last handshake
+    double elapsed(phase p) const {
+        return std::chrono::duration<double, std::micro>(marks_[p + 1] - marks_[p]).count();
+    }
+
+    void bulk(size_t chunk, const bool& stop) {
+        out_.assign(chunk, 0x5a);
+        in_.resize(chunk);
+        write_bulk(stop);
+        read_bulk();
+    }
+
+    void pingpong(size_t msg, const bool& stop) {
+        out_.assign(msg, 0x5a);
+        in_.resize(msg);
+        ping(stop);
+    }
+
+    void close() {
+        std::error_code ec;
+        socket_.close(ec);
+    }
+
+    // RST instead of FIN, churning clients would run out of ports in TIME_WAIT
+    void abort() {
+        std::error_code ec;
+        socket_.set_option(tcp::socket::linger(true, 0), ec);
+        socket_.close(ec);
+    }
+
+    uint64_t received() const {
+        return received_;
+    }
+
+    const std::vector<double>& rtts() const {
+        return rtts_;
+    }
+
+private:
+    void command() {
+        auto port = target_.port();
+        request_ = {0x05, 0x01, 0x00};
+        if (domain_.empty() && target_.address().is_v4()) {
+            auto ip = target_.address().to_v4().to_bytes();
+            request_.insert(request_.end(), {0x01, ip[0], ip[1], ip[2], ip[3]});
+        } else if (domain_.empty()) {
+            auto ip = target_.address().to_v6().to_bytes();
+            request_.push_back(0x04);
+            request_.insert(request_.end(), ip.begin(), ip.end());
+        } else {
+            request_.push_back(0x03);
+            request_.push_back(static_cast<uint8_t>(domain_.size()));
+            request_.insert(request_.end(), domain_.begin(), domain_.end());
+        }
+        request_.push_back(static_cast<uint8_t>(port >> 8u));
+        request_.push_back(static_cast<uint8_t>(port & 0xffu));
+        auto self = shared_from_this();
+        asio::async_write(socket_, asio::buffer(request_), [this, self](const std::error_code& ec, size_t) {
+            if (ec) {
+                return finish(false);
+            }
+            // the reply has the size of the request
+            asio::async_read(socket_, asio::buffer(reply_, request_.size()), [this, self](const std::error_code& ec, size_t) {
+                marks_[3] = clock_type::now();
+                finish(!ec && reply_[1] == 0x00);
+            });
+        });
+    }
+
+    void finish(bool ok) {
+        auto done = std::move(done_);
+        done(ok);
+    }
+
+    void write_bulk(const bool& stop) {
+        if (stop) {
+            return;
+        }
+        auto self = shared_from_this();
+        asio::async_write(socket_, asio::buffer(out_), [this, self, &stop](const std::error_code& ec, size_t) {
+            if (ec) {
+                return;
+            }
+            write_bulk(stop);
+        });
+    }
+
+    void read_bulk() {
+        auto self = shared_from_this();
+        socket_.async_read_some(asio::buffer(in_), [this, self](const std::error_code& ec, size_t sz) {
+            if (ec) {
+                return;
+            }
+            received_ += sz;
+            read_bulk();
+        });
+    }
+
+    void ping(const bool& stop) {
+        if (stop) {
+            return;
+        }
+        auto self = shared_from_this();
+        auto t0 = clock_type::now();
+        asio::async_write(socket_, asio::buffer(out_), [this, self, &stop, t0](const std::error_code& ec, size_t) {
+            if (ec) {
+                return;
+            }
+            asio::async_read(socket_, asio::buffer(in_), [this, self, &stop, t0](const std::error_code& ec, size_t sz) {
+                if (ec) {
+                    return;
+                }
+                received_ += sz;
+                rtts_.push_back(std::chrono::duration<double, std::micro>(clock_type::now() - t0).count());
+                ping(stop);
+            });
+        });
+    }
+
+    tcp::socket socket_;
+    tcp::endpoint proxy_;
+    tcp::endpoint target_;
+    std::string domain_;
+    std::function<void(bool)> done_;
+    std::array<clock_type::time_point, PHASES + 1> marks_;
+    std::vector<uint8_t> request_;
+    std::array<uint8_t, 4 + 1 + 255 + 2> reply_;
+    std::vector<uint8_t> out_;
+    std::vector<uint8_t> in_;
+    uint64_t received_;
+    std::vector<double> rtts_;
+};
+
+double cpu_seconds() {
+    rusage ru{};
+    getrusage(RUSAGE_SELF, &ru);
+    auto tv = [](const timeval& t) {
+        return static_cast<double>(t.tv_sec) + static_cast<double>(t.tv_usec) / 1e6;
+    };
+    return tv(ru.ru_utime) + tv(ru.ru_stime);
+}
+
+double percentile(const std::vector<double>& sorted, double p) {
+    if (sorted.empty()) {
+        return 0.0;
+    }
+    auto i = static_cast<size_t>(p * static_cast<double>(sorted.size() - 1) + 0.5);
+    return sorted[std::min(i, sorted.size() - 1)];
+}
+
+struct harness {
+    asio::io_context ctx;
+    tcp::endpoint proxy;
+    tcp::endpoint target;
+    std::string domain;
+    bool stop = false;
+
+    // opens n tunnelled connections, false if any of them failed
+    bool connect(size_t n, std::vector<std::shared_ptr<client>>& clients) {
+        stop = false;
+        size_t failed = 0;
+        for (size_t i = 0; i < n; ++i) {
+            auto c = std::make_shared<client>(ctx, proxy, target, domain);
+            clients.push_back(c);
+            c->handshake([&failed](bool ok) {
+                failed += ok ? 0 : 1;
+            });
+        }
+        ctx.restart();
+        ctx.run();
+        if (failed > 0) {
+            std::cerr << failed << " of " << n << " connections failed" << std::endl;
+        }
+        return failed == 0;
+    }
+
+    // runs the clients for the given time, then closes them
+    void run_for(int seconds, std::vector<std::shared_ptr<client>>& clients) {
+        asio::steady_timer timer{ctx, std::chrono::seconds(seconds)};
+        timer.async_wait([this, &clients](const std::error_code&) {
+            stop = true;
+            for (auto& c: clients) {
+                c->close();
+            }
+        });
+        ctx.restart();
+        ctx.run();
+    }
+};
+
+void throughput(harness& h, size_t conns, size_t chunk, int seconds) {
+    std::vector<std::shared_ptr<client>> clients;
+    if (!h.connect(conns, clients)) {
+        return;
+    }
+    for (auto& c: clients) {
+        c->bulk(chunk, h.stop);
+    }
+    auto cpu0 = cpu_seconds();
+    auto t0 = clock_type::now();
+    h.run_for(seconds, clients);
+    auto secs = std::chrono::duration<double>(clock_type::now() - t0).count();
+    auto cpu = cpu_seconds() - cpu0;
+
+    uint64_t total = 0;
+    std::vector<double> per_conn;
+    for (auto& c: clients) {
+        total += c->received();
+        per_conn.push_back(static_cast<double>(c->received()) * 8 / secs / 1e6);
+    }
+    std::sort(per_conn.begin(), per_conn.end());
+    // every byte went through the tunnel twice, up to the echo target and back
+    auto gb = static_cast<double>(total) * 2 / 1e9;
+    std::cout << fmt::format("throughput: {} conns, {:.0f} Mbit/s echoed, {:.0f} Mbit/s through the tunnel",
+        conns, static_cast<double>(total) * 8 / secs / 1e6, gb * 8e3 / secs) << std::endl;
+    std::cout << fmt::format("per conn Mbit/s: min {:.1f}, p50 {:.1f}, max {:.1f}",
+        per_conn.front(), percentile(per_conn, 0.5), per_conn.back()) << std::endl;
+    std::cout << fmt::format("cpu: {:.2f} s over {:.2f} s, {:.2f} cpu s/GB", cpu, secs, gb > 0 ? cpu / gb : 0.0)
+              << std::endl;
+}
+
+void latency(harness& h, size_t conns, size_t msg, int seconds) {
+    std::vector<std::shared_ptr<client>> clients;
+    if (!h.connect(conns, clients)) {
+        return;
+    }
+    for (auto& c: clients) {
+        c->pingpong(msg, h.stop);
+    }
+    h.run_for(seconds, clients);
+
+    std::vector<double> rtts;
+    for (auto& c: clients) {
+        rtts.insert(rtts.end(), c->rtts().begin(), c->rtts().end());
+    }
+    std::sort(rtts.begin(), rtts.end());
+    std::cout << fmt::format("latency: {} conns, {} B messages, {} round trips, {:.0f}/s", conns, msg, rtts.size(),
+        static_cast<double>(rtts.size()) / seconds) << std::endl;
+    std::cout << fmt::format("rtt us: p50 {:.1f}, p99 {:.1f}, p999 {:.1f}, max {:.1f}",
+        percentile(rtts, 0.5), percentile(rtts, 0.99), percentile(rtts, 0.999),
+        rtts.empty() ? 0.0 : rtts.back()) << std::endl;
+}
+
+void cps(harness& h, size_t conns, int seconds) {
+    auto& hs = mole::handshake_stats::self();
+    hs.clear();
+    hs.enable(true);
+
+    std::array<std::vector<double>, client::PHASES + 1> lat;
+    size_t done = 0;
+    size_t failed = 0;
+    h.stop = false;
+    // every slot opens the next connection as soon as its previous handshake finished
+    std::function<void()> next = [&]() {
+        if (h.stop) {
+            return;
+        }
+        auto c = std::make_shared<client>(h.ctx, h.proxy, h.target, h.domain);
+        c->handshake([&, c](bool ok) {
+            if (ok) {
+                ++done;
+                double total = 0;
+                for (size_t i = 0; i < client::PHASES; ++i) {
+                    auto us = c->elapsed(static_cast<client::phase>(i));
+                    lat[i].push_back(us);
+                    total += us;
+                }
+                lat[client::PHASES].push_back(total);
+            } else {
+                ++failed;
+            }
+            c->abort();
+            next();
+        });
+    };
+    for (size_t i = 0; i < conns; ++i) {
+        next();
+    }
+
+    asio::steady_timer timer{h.ctx, std::chrono::seconds(seconds)};
+    timer.async_wait([&h](const std::error_code&) {
+        h.stop = true;
+    });
+    // handshakes stuck past the end are not waited for
+    asio::steady_timer deadline{h.ctx, std::chrono::seconds(seconds + 2)};
+    deadline.async_wait([&h](const std::error_code&) {
+        h.ctx.stop();
+    });
+    auto t0 = clock_type::now();
+    h.ctx.restart();
+    h.ctx.run();
+    auto secs = std::min(std::chrono::duration<double>(clock_type::now() - t0).count(), static_cast<double>(seconds));
+    hs.enable(false);
+
+    std::cout << fmt::format("cps: {} concurrent, {} handshakes, {} failed, {:.0f} conn/s, target {}",
+        conns, done, failed, static_cast<double>(done) / secs, h.domain.empty() ? "by ip" : h.domain) << std::endl;
+    std::cout << "phase                     count      p50 us      p99 us     p999 us      max us" << std::endl;
+    const char *names[] = {"client tcp_connect", "client greeting", "client request", "client total"};
+    for (size_t i = 0; i < lat.size(); ++i) {
+        auto& v = lat[i];
+        std::sort(v.begin(), v.end());
+        std::cout << fmt::format("{:<22} {:>8} {:>11.1f} {:>11.1f} {:>11.1f} {:>11.1f}", names[i], v.size(),
+            percentile(v, 0.5), percentile(v, 0.99), percentile(v, 0.999), v.empty() ? 0.0 : v.back()) << std::endl;
+    }
+    for (size_t i = 0; i < mole::handshake_stats::PHASES; ++i) {
+        auto p = static_cast<mole::handshake_stats::phase>(i);
+        auto sm = hs.get(p);
+        std::cout << fmt::format("{:<22} {:>8} {:>11.1f} {:>11.1f} {:>11} {:>11.1f}", mole::handshake_stats::name(p),
+            sm.count, sm.p50, sm.p99, "-", sm.max) << std::endl;
+    }
+}
+
+
+// memory and fds of this process
+struct proc_stats {
+    uint64_t rss;
+    uint64_t heap;
+    uint64_t fds;
+    // idle buffers and sessions kept by the pools, part of rss and heap but not held by any
+    // connection; filled in by the child, which knows its session type
+    uint64_t pooled;
+
+    static proc_stats now() {
+        proc_stats st{};
+        std::ifstream statm{"/proc/self/statm"};
+        uint64_t size = 0;
+        uint64_t resident = 0;
+        statm >> size >> resident;
+        st.rss = resident * static_cast<uint64_t>(sysconf(_SC_PAGESIZE));
+        // bytes handed out by malloc, small chunks and mmapped ones, over all arenas
+        auto mi = mallinfo2();
+        st.heap = mi.uordblks + mi.hblkhd;
+        if (auto *dir = opendir("/proc/self/fd")) {
+            while (auto *e = readdir(dir)) {
+                st.fds += e->d_name[0] == '.' ? 0 : 1;
+            }
+            closedir(dir);
+            // the one opendir holds
+            st.fds -= 1;
+        }
+        return st;
+    }
+};
+
+// a tcp_srv in a forked child: writes its port, then its proc_stats on each 'm', exits on anything else
+struct child {
+    pid_t pid = -1;
+    int cmd = -1;
+    int out = -1;
+    uint16_t port = 0;
+
+    template<typename Session>
+    static child spawn(size_t threads, size_t crypto_threads) {
+        int cmd[2];
+        int out[2];
+        child c;
+        if (pipe(cmd) != 0 || pipe(out) != 0) {
+            return c;
+        }
+        c.pid = fork();
+        if (c.pid == 0) {
+            close(cmd[1]);
+            close(out[0]);
+            mole::crypto_pool::self().start(crypto_threads);
+            {
+                mole::tcp_srv<Session> srv{0, threads};
+                srv.start();
+                auto port = srv.port();
+                (void)!write(out[1], &port, sizeof(port));
+                char m = 0;
+                while (read(cmd[0], &m, 1) == 1 && m == 'm') {
+                    auto st = proc_stats::now();
+                    st.pooled = mole::buffer_pool::idle_bytes() + mole::session_pool<Session>::idle_bytes();
+                    (void)!write(out[1], &st, sizeof(st));
+                }
+                srv.stop();
+                // before the contexts of srv go, its sessions may still be in crypto jobs
+                mole::crypto_pool::self().stop();
+            }
+            _exit(0);
+        }
+        close(cmd[0]);
+        close(out[1]);
+        c.cmd = cmd[1];
+        c.out = out[0];
+        if (c.pid < 0 || read(c.out, &c.port, sizeof(c.port)) != sizeof(c.port)) {
+            c.port = 0;
+        }
+        return c;
+    }
+
+    proc_stats stats() const {
+        proc_stats st{};
+        char m = 'm';
+        if (write(cmd, &m, 1) != 1 || read(out, &st, sizeof(st)) != sizeof(st)) {
+            std::cerr << "child " << pid << " gone" << std::endl;
+        }
+        return st;
+    }
+
+    void quit() {
+        if (pid <= 0) {
+            return;
+        }
+        char m = 'q';
+        (void)!write(cmd, &m, 1);
+        close(cmd);
+        close(out);
+        waitpid(pid, nullptr, 0);
+        pid = -1;
+    }
+};
+
+// the per connection figures leave out what the pools keep idle, it is a fixed cost that
+// would otherwise make them depend on the number of connections
+void print_cost(const char *name, const proc_stats& before, const proc_stats& after, size_t n) {
+    auto per = [n](uint64_t a, uint64_t b) {
+        return n == 0 ? 0.0 : (static_cast<double>(a) - static_cast<double>(b)) / static_cast<double>(n);
+    };
+    auto pooled = static_cast<double>(after.pooled) - static_cast<double>(before.pooled);
+    auto per_pooled = [n, pooled](uint64_t a, uint64_t b) {
+        return n == 0 ? 0.0 : (static_cast<double>(a) - static_cast<double>(b) - pooled) / static_cast<double>(n);
+    };
+    std::cout << fmt::format("{:<8} {:>10.1f} {:>10.1f} {:>8.2f} {:>12.1f} {:>12.1f} {:>8} {:>10.1f}", name,
+        per_pooled(after.rss, before.rss), per_pooled(after.heap, before.heap), per(after.fds, before.fds),
+        static_cast<double>(after.rss) / (1 << 20), static_cast<double>(after.heap) / (1 << 20), after.fds,
+        static_cast<double>(after.pooled) / 1024) << std::endl;
+}
+
+int idle(size_t conns, size_t threads, size_t crypto_threads, const asio::ip::address& loopback,
+    const std::string& domain) {
+    // every idle connection costs the bench 1 fd, local 2, remote 2 and the target 1
+    rlimit rl{};
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+    if (rl.rlim_cur < conns * 2 + 64) {
+        std::cerr << fmt::format("RLIMIT_NOFILE {} is too low for {} conns, raise it (ulimit -n)", rl.rlim_cur, conns)
+                  << std::endl;
+    }
+
+    auto& cfg = mole::mole_cfg::self();
+    // children first, before this process has any thread
+    auto remote = child::spawn<mole::remote_session>(threads, crypto_threads);
+    cfg.remote_endpoint({loopback, remote.port});
+    auto local = child::spawn<mole::local_session>(threads, crypto_threads);
+    if (remote.port == 0 || local.port == 0) {
+        std::cerr << "can NOT start local and remote" << std::endl;
+        remote.quit();
+        local.quit();
+        return 1;
+    }
+
+    mole::tcp_srv<echo_session> target{0};
+    target.start();
+    harness h;
+    h.proxy = {loopback, local.port};
+    h.target = {loopback, target.port()};
+    h.domain = domain;
+
+    auto local0 = local.stats();
+    auto remote0 = remote.stats();
+
+    // a bounded number of handshakes in flight, the backlogs would drop the rest
+    std::vector<std::shared_ptr<client>> clients;
+    clients.reserve(conns);
+    size_t opened = 0;
+    size_t failed = 0;
+    std::function<void()> next = [&]() {
+        if (clients.size() >= conns) {
+            return;
+        }
+        auto c = std::make_shared<client>(h.ctx, h.proxy, h.target, h.domain);
+        clients.push_back(c);
+        c->handshake([&](bool ok) {
+            ok ? ++opened : ++failed;
+            next();
+        });
+    };
+    for (size_t i = 0; i < std::min<size_t>(conns, 256); ++i) {
+        next();
+    }
+    auto t0 = clock_type::now();
+    h.ctx.restart();
+    h.ctx.run();
+    auto secs = std::chrono::duration<double>(clock_type::now() - t0).count();
+
+    // let the sessions reach their idle state and return what the handshake borrowed
+    std::this_thread::sleep_for(std::chrono::seconds(1));
+    auto local1 = local.stats();
+    auto remote1 = remote.stats();
+
+    std::cout << fmt::format("idle: {} conns open, {} failed, opened in {:.1f} s", opened, failed, secs) << std::endl;
+    std::cout << fmt::format("sizeof local_session {}, remote_session {}", sizeof(mole::local_session),
+        sizeof(mole::remote_session)) << std::endl;
+    std::cout << "process  rss B/conn heap B/conn fds/conn  rss MiB tot heap MiB tot  fds tot pooled KiB" << std::endl;
+    print_cost("local", local0, local1, opened);
+    print_cost("remote", remote0, remote1, opened);
+
+    for (auto& c: clients) {
+        c->abort();
+    }
+    target.stop();
+    local.quit();
+    remote.quit();
+    return failed == 0 ? 0 : 1;
+}
+
+}
+
+int main(int argc, char** argv) {
+    cxxopts::Options options("mole_e2e_bench", "loopback tunnel benchmark");
+    options.add_options()("help", "show help");
+    options.add_options()("m,mode", "what to measure", cxxopts::value<std::string>()->default_value("throughput"),
+        "throughput/latency/cps/idle");
+    options.add_options()("c,conns", "client connections", cxxopts::value<size_t>()->default_value("8"), "conns");
+    options.add_options()("s,seconds", "seconds per run", cxxopts::value<int>()->default_value("5"), "seconds");
+    options.add_options()("t,threads", "threads of local and of remote", cxxopts::value<size_t>()->default_value("1"), "threads");
+    options.add_options()("chunk", "bytes per bulk write", cxxopts::value<size_t>()->default_value("65536"), "bytes");
+    options.add_options()("msg", "bytes per latency message", cxxopts::value<size_t>()->default_value("64"), "bytes");
+    options.add_options()("domain", "cps: send the target by this name, e.g. localhost", cxxopts::value<std::string>(), "name");
+    options.add_options()("6,ipv6", "every hop over ::1 instead of 127.0.0.1");
+    options.add_options()("dns-standin", "cps: resolve --domain through a stand-in nameserver answering with this TTL",
+        cxxopts::value<uint32_t>(), "seconds");
+    options.add_options()("max-frame", "max bytes per tunnel frame", cxxopts::value<size_t>()->default_value("32768"), "bytes");
+    options.add_options()("crypto-threads", "crypto_pool workers", cxxopts::value<size_t>()->default_value("0"), "threads");
+    auto args = options.parse(argc, argv);
+    if (args.count("help") > 0) {
+        std::cout << options.help({}) << std::endl;
+        return 0;
+    }
+
+    mole::logging_init("bench");
+    spdlog::set_level(spdlog::level::warn);
+    if (!mole::mole_crypto::init()) {
+        std::cerr << "crypto init failed" << std::endl;
+        return 1;
+    }
+
+    auto mode = args["mode"].as<std::string>();
+    auto conns = args["conns"].as<size_t>();
+    auto seconds = args["seconds"].as<int>();
+    auto threads = args["threads"].as<size_t>();
+
+    auto& cfg = mole::mole_cfg::self();
+    cfg.key("bench");
+    cfg.max_frame(std::min(std::max(args["max-frame"].as<size_t>(), mole::MIN_FRAME_SIZE), mole::MAX_FRAME_SIZE));
+    mole::key_manager::self().init(cfg.key(), cfg.hint_key());
+    auto loopback = args.count("ipv6") > 0 ? asio::ip::address{asio::ip::address_v6::loopback()}
+                                           : asio::ip::address{asio::ip::address_v4::loopback()};
+    if (mode == "idle") {
+        return idle(conns, threads, args["crypto-threads"].as<size_t>(), loopback,
+            args.count("domain") > 0 ? args["domain"].as<std::string>() : std::string{});
+    }
+    mole::crypto_pool::self().start(args["crypto-threads"].as<size_t>());
+
+    // the stand-in has a thread of its own, for the remote it is just a nameserver
+    asio::io_context dns_ctx{1};
+    std::unique_ptr<dns_standin> standin;
+    std::thread dns_thread;
+    if (args.count("dns-standin") > 0) {
+        standin = std::make_unique<dns_standin>(dns_ctx, args["dns-standin"].as<uint32_t>());
+        cfg.nameservers({standin->endpoint()});
+        dns_thread = std::thread{[&dns_ctx]() {
+            dns_ctx.run();
+        }};
+    }
+
+    mole::tcp_srv<echo_session> target{0};
+    target.start();
+    mole::tcp_srv<mole::remote_session> remote{0, threads};
+    remote.start();
+    cfg.remote_endpoint({loopback, remote.port()});
+    mole::tcp_srv<mole::local_session> local{0, threads};
+    local.start();
+
+    harness h;
+    h.proxy = {loopback, local.port()};
+    h.target = {loopback, target.port()};
+    if (args.count("domain") > 0) {
+        h.domain = args["domain"].as<std::string>();
+    }
+    if (mode == "throughput") {
+        throughput(h, conns, args["chunk"].as<size_t>(), seconds);
+        latency(h, conns, args["msg"].as<size_t>(), seconds);
+    } else if (mode == "latency") {
+        latency(h, conns, args["msg"].as<size_t>(), seconds);
+    } else if (mode == "cps") {
+        cps(h, conns, seconds);
+        if (standin) {
+            std::cout << fmt::format("dns stand-in answered {} queries", standin->queries()) << std::endl;
+        }
+    } else {
+        std::cout << options.help({}) << std::endl;
+    }
+
+    local.stop();
+    remote.stop();
+    target.stop();
+    dns_ctx.stop();
+    if (dns_thread.joinable()) {
+        dns_thread.join();
+    }
+    mole::crypto_pool::self().stop();
+    return 0;
+}
@@ -0,0 +1,329 @@
+#include <sodium.h>
+
+#include <atomic>
+#include <chrono>
+#include <fstream>
+#include <iostream>
+#include <new>
+#include <sstream>
+
+#include "buffer_pool.hpp"
+#include "domain_cache.hpp"
+#include "frame_reader.hpp"
+#include "mole_crypto.hpp"
+#include "proto.hpp"
+#include "router.hpp"
+#include "utils.hpp"
+#include "write_queue.hpp"
+
+#include "cxxopts.hpp"
+#include "nlohmann/json.hpp"
+
+// Data path micro benchmarks: AEAD per frame, the frame encode/decode loop of the sessions,
+// domain_cache and router. Reports ns per frame, GB/s and heap allocations per frame; -o writes the same
+// numbers as JSON so builds can be compared.
+
+namespace {
+
+std::atomic<uint64_t> allocations{0};
+
+}
+
+void *operator new(size_t size) {
+    allocations.fetch_add(1, std::memory_order_relaxed);
+    if (auto *p = std::malloc(size == 0 ? 1 : size)) {
+        return p;
+    }
+    throw std::bad_alloc{};
+}
+
+void *operator new[](size_t size) {
+    return operator new(size);
+}
+
+void operator delete(void *p) noexcept {
+    std::free(p);
+}
+
+void operator delete[](void *p) noexcept {
+    std::free(p);
+}
+
+void operator delete(void *p, size_t) noexcept {
+    std::free(p);
+}
+
+void operator delete[](void *p, size_t) noexcept {
+    std::free(p);
+}
+
+namespace {
+
+using mole::mole_crypto;
+
+struct result {
+    std::string name;
+    std::string cipher;
+    size_t size;
+    size_t frames;
+    double ns;
+    double allocs;
+
+    double gbps() const {
+        return size == 0 ? 0.0 : static_cast<double>(size) / ns;
+    }
+};
+
+template<typename F>
+result run(const std::string& name, const std::string& cipher, size_t size, size_t frames, F&& f) {
+    // one pass to warm caches and pools
+    for (size_t i = 0; i < std::min<size_t>(frames, 64); ++i) {
+        f();
+    }
+    auto a0 = allocations.load();
+    auto t0 = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < frames; ++i) {
+        f();
+    }
+    auto t1 = std::chrono::steady_clock::now();
+    auto a1 = allocations.load();
+    auto ns = std::chrono::duration<double, std::nano>(t1 - t0).count() / static_cast<double>(frames);
+    return {name, cipher, size, frames, ns, static_cast<double>(a1 - a0) / static_cast<double>(frames)};
+}
+
+// a local/remote pair sharing one session, as after the hello
+struct session_pair {
+    mole_crypto local;
+    mole_crypto remote;
+
+    session_pair(const std::shared_ptr<const mole::mole_key>& key, mole_crypto::cipher c):
+        local{key, mole_crypto::role::local}, remote{key, mole_crypto::role::remote} {
+        uint8_t nonce[24];
+        local.nonce_copy_to(nonce);
+        remote.key(key);
+        remote.nonce(nonce);
+        local.use(c);
+        remote.use(c);
+    }
+};
+
+bool crypto_cases(std::vector<result>& out, const std::vector<size_t>& sizes, size_t total, mole_crypto::cipher c) {
+    auto key = mole::mole_key::make("", "bench");
+    auto name = mole_crypto::name(c);
+    for (auto size: sizes) {
+        auto frames = std::max<size_t>(total / size, 1000);
+        session_pair sp{key, c};
+        std::vector<uint8_t> plain(size + mole_crypto::extra_size());
+        std::vector<uint8_t> sealed(size + mole_crypto::extra_size());
+        randombytes_buf(plain.data(), size);
+
+        out.push_back(run("encrypt", name, size, frames, [&]() {
+            sp.local.encrypt(plain.data(), size, plain.data());
+        }));
+
+        // the same frame opened over and over, to a separate buffer so it stays intact; it has to
+        // open once, or the loop would only time the rejected MAC
+        if (!sp.local.seal(0, plain.data(), size, sealed.data()) ||
+            !sp.remote.open(0, sealed.data(), sealed.size(), plain.data())) {
+            std::cerr << "decrypt failed at size " << size << std::endl;
+            return false;
+        }
+        out.push_back(run("decrypt", name, size, frames, [&]() {
+            sp.remote.open(0, sealed.data(), sealed.size(), plain.data());
+        }));
+    }
+    return true;
+}
+
+bool frame_cases(std::vector<result>& out, const std::vector<size_t>& sizes, size_t total, mole_crypto::cipher c) {
+    constexpr size_t DEPTH = 4;
+    auto key = mole::mole_key::make("", "bench");
+    auto name = mole_crypto::name(c);
+    for (auto size: sizes) {
+        auto frames = std::max<size_t>(total / size, 1000);
+        session_pair sp{key, c};
+        mole::frame_reader reader{DEPTH * (size + mole::buffer_pool::HEADROOM), size + mole::buffer_pool::HEADROOM};
+        reader.configure(DEPTH * (size + mole::buffer_pool::HEADROOM), size + mole::buffer_pool::HEADROOM,
+            mole::frame_format::v2);
+        std::deque<mole::pending_write> queue;
+        bool failed = false;
+
+        out.push_back(run("frame", name, size, frames, [&]() {
+            // sender, as local_stream: borrow a block, seal in place behind the header room
+            auto buff = mole::buffer_pool::acquire(size + mole::buffer_pool::HEADROOM);
+            auto *data = buff.get() + mole::FRAME_HEADER_MAX;
+            auto pl = size + mole_crypto::extra_size();
+            failed |= !sp.local.encrypt(data, size, data);
+            auto hl = mole::put_frame_header(mole::frame_format::v2, pl, data);
+            queue.push_back({std::move(buff), mole::FRAME_HEADER_MAX - hl, pl + hl});
+
+            // the socket in between is a copy into the reader's ring
+            auto bb = queue.front().buffer();
+            reader.append(static_cast<const uint8_t*>(bb.data()), bb.size());
+            queue.pop_front();
+
+            // receiver, as remote_stream: decode, open in place, release once written
+            mole::frame_reader::frame f{};
+            failed |= reader.next(f) != mole::frame_reader::result::frame;
+            failed |= !sp.remote.decrypt(f.data, f.size, f.data);
+            reader.release(f.end);
+        }));
+        if (failed) {
+            std::cerr << "frame loop failed at size " << size << std::endl;
+            return false;
+        }
+    }
+    return true;
+}
+
+bool cache_cases(std::vector<result>& out, size_t ops) {
+    auto& dc = mole::domain_cache::self();
+    std::vector<std::string> domains;
+    for (size_t i = 0; i < 1024; ++i) {
+        domains.push_back(fmt::format("host{}.example.com", i));
+    }
+    mole::domain_cache::endpoint_vector eps{
+        {asio::ip::make_address("192.0.2.1"), 443},
+        {asio::ip::make_address("192.0.2.2"), 443},
+    };
+    size_t i = 0;
+    out.push_back(run("cache_set", "", 0, ops, [&]() {
+        dc.set(domains[i++ % domains.size()], eps, std::chrono::seconds(60));
+    }));
+    i = 0;
+    size_t hits = 0;
+    out.push_back(run("cache_get", "", 0, ops, [&]() {
+        hits += dc.get(domains[i++ % domains.size()]).size();
+    }));
+    if (hits == 0) {
+        std::cerr << "domain_cache never hit" << std::endl;
+        return false;
+    }
+    // one-off names, as a crawler sends them, make the cache evict
+    i = 0;
+    out.push_back(run("cache_churn", "", 0, ops, [&]() {
+        dc.set(fmt::format("once{}.example.net", i++), eps, std::chrono::seconds(60));
+    }));
+    return true;
+}
+
+bool route_cases(std::vector<result>& out, size_t ops) {
+    // 100k rules of every kind, about the size of the public block and geo lists
+    std::ostringstream rules;
+    for (size_t i = 0; i < 60000; ++i) {
+        rules << "suffix site" << i << ".com " << (i % 2 ? "direct" : "reject") << "\n";
+    }
+    for (size_t i = 0; i < 10000; ++i) {
+        rules << "domain host" << i << ".example.org direct\n";
+    }
+    for (size_t i = 0; i < 100; ++i) {
+        rules << "keyword tracker" << i << " reject\n";
+    }
+    for (size_t i = 0; i < 25000; ++i) {
+        rules << "cidr 10." << i / 256 << "." << i % 256 << ".0/24 direct\n";
+    }
+    for (size_t i = 0; i < 5000; ++i) {
+        rules << "cidr 2001:db8:" << std::hex << i << std::dec << "::/48 direct\n";
+    }
+    std::istringstream is{rules.str()};
+    auto& r = mole::router::self();
+    if (!r.load(is, "bench rules")) {
+        return false;
+    }
+    using act = mole::router::action;
+    if (r.route("a.b.site7.com") != act::direct || r.route("site8.com") != act::reject ||
+        r.route("x.host5.example.org") != act::tunnel || r.route("eu.tracker42.net") != act::reject ||
+        r.route(asio::ip::make_address("10.1.2.3")) != act::direct ||
+        r.route(asio::ip::make_address("10.200.2.3")) != act::tunnel ||
+        r.route(asio::ip::make_address("2001:db8:12::1")) != act::direct) {
+        std::cerr << "router picked a wrong action" << std::endl;
+        return false;
+    }
+
+    std::vector<std::string> names;
+    std::vector<asio::ip::address> addrs;
+    for (size_t i = 0; i < 1024; ++i) {
+        // half of them match a rule
+        names.push_back(i % 2 ? fmt::format("www.site{}.com", i * 37) : fmt::format("cdn{}.unlisted.net", i));
+        addrs.push_back(asio::ip::make_address(fmt::format("10.{}.{}.1", i % 200, i % 256)));
+    }
+    size_t i = 0;
+    size_t direct = 0;
+    out.push_back(run("route_name", "", 0, ops, [&]() {
+        direct += r.route(names[i++ % names.size()]) == act::direct;
+    }));
+    i = 0;
+    out.push_back(run("route_ip", "", 0, ops, [&]() {
+        direct += r.route(addrs[i++ % addrs.size()]) == act::direct;
+    }));
+    return direct > 0;
+}
+
+}
+
+int main(int argc, char** argv) {
+    cxxopts::Options options("mole_bench", "data path micro benchmarks");
+    options.add_options()("help", "show help");
+    options.add_options()("b,bytes", "bytes to process per case", cxxopts::value<size_t>()->default_value("67108864"), "bytes");
+    options.add_options()("n,ops", "domain_cache operations", cxxopts::value<size_t>()->default_value("1000000"), "ops");
+    options.add_options()("o,output", "write results as JSON", cxxopts::value<std::string>(), "file");
+    auto args = options.parse(argc, argv);
+    if (args.count("help") > 0) {
+        std::cout << options.help({}) << std::endl;
+        return 0;
+    }
+    if (!mole_crypto::init()) {
+        std::cerr << "crypto init failed" << std::endl;
+        return 1;
+    }
+    auto total = args["bytes"].as<size_t>();
+
+    const std::vector<size_t> sizes{64, 256, 1024, 1500, 4096, 16384, 32768, 65536};
+    std::vector<mole_crypto::cipher> ciphers{mole_crypto::cipher::chacha20_poly1305};
+    if (mole_crypto::available() & static_cast<uint8_t>(mole_crypto::cipher::aes256_gcm)) {
+        ciphers.push_back(mole_crypto::cipher::aes256_gcm);
+    }
+
+    std::vector<result> results;
+    for (auto c: ciphers) {
+        if (!crypto_cases(results, sizes, total, c) || !frame_cases(results, sizes, total, c)) {
+            return 1;
+        }
+    }
+    if (!cache_cases(results, args["ops"].as<size_t>()) || !route_cases(results, args["ops"].as<size_t>())) {
+        return 1;
+    }
+
+    std::cout << "case       cipher               size      ns/op     GB/s  allocs/op" << std::endl;
+    for (auto& r: results) {
+        std::cout << fmt::format("{:<10} {:<18} {:>7} {:>10.1f} {:>8.2f} {:>10.2f}",
+            r.name, r.cipher, r.size, r.ns, r.gbps(), r.allocs) << std::endl;
+    }
+    auto u = mole::domain_cache::self().stats();
+    std::cout << fmt::format("domain_cache: {} names, {:.0f} bytes/name, {} evicted", u.entries,
+        u.entries == 0 ? 0.0 : static_cast<double>(u.bytes) / u.entries, u.evicted) << std::endl;
+
+    if (args.count("output") > 0) {
+        nlohmann::json jj;
+        jj["version"] = 1;
+        for (auto& r: results) {
+            jj["results"].push_back({
+                {"case", r.name},
+                {"cipher", r.cipher},
+                {"size", r.size},
+                {"ops", r.frames},
+                {"ns_per_op", r.ns},
+                {"gb_per_s", r.gbps()},
+                {"allocs_per_op", r.allocs},
+            });
+        }
+        auto path = args["output"].as<std::string>();
+        std::ofstream ofs{path};
+        ofs << jj.dump(2) << std::endl;
+        if (!ofs) {
+            std::cerr << "can NOT write " << path << std::endl;
+            return 1;
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,94 @@
+#include <algorithm>
+#include <atomic>
+#include <mutex>
+#include <vector>
+
+#include "buffer_pool.hpp"
+
+namespace mole {
+
+namespace {
+
+// idle bytes kept per thread, all sizes together
+constexpr size_t MAX_IDLE_BYTES = 1024 * 1024 * 8;
+
+struct free_list {
+    size_t size;
+    std::vector<uint8_t*> blocks;
+};
+
+struct free_lists;
+
+// every thread's free lists, only for idle_bytes() to add up
+std::mutex all_mtx;
+std::vector<free_lists*> all;
+
+struct free_lists {
+    std::vector<free_list> lists;
+    // written by the owning thread only, read by idle_bytes()
+    std::atomic<size_t> idle{0};
+
+    free_lists() {
+        std::lock_guard<std::mutex> lock{all_mtx};
+        all.push_back(this);
+    }
+
+    ~free_lists() {
+        {
+            std::lock_guard<std::mutex> lock{all_mtx};
+            all.erase(std::find(all.begin(), all.end(), this));
+        }
+        for (auto& l: lists) {
+            for (auto *b: l.blocks) {
+                delete[] b;
+            }
+        }
+    }
+
+    free_list& of(size_t size) {
+        // only a handful of sizes are ever used, negotiated frame sizes are powers of two
+        for (auto& l: lists) {
+            if (l.size == size) {
+                return l;
+            }
+        }
+        lists.push_back({size, {}});
+        return lists.back();
+    }
+};
+
+thread_local free_lists idle_blocks;
+
+}
+
+buffer_pool::buffer buffer_pool::acquire(size_t size) {
+    auto& blocks = idle_blocks.of(size).blocks;
+    if (blocks.empty()) {
+        return buffer{new uint8_t[size], deleter{size}};
+    }
+    auto *b = blocks.back();
+    blocks.pop_back();
+    idle_blocks.idle.store(idle_blocks.idle.load(std::memory_order_relaxed) - size, std::memory_order_relaxed);
+    return buffer{b, deleter{size}};
+}
+
+void buffer_pool::release(uint8_t *block, size_t size) {
+    auto idle = idle_blocks.idle.load(std::memory_order_relaxed);
+    if (idle + size > MAX_IDLE_BYTES) {
+        delete[] block;
+        return;
+    }
+    idle_blocks.of(size).blocks.push_back(block);
+    idle_blocks.idle.store(idle + size, std::memory_order_relaxed);
+}
+
+size_t buffer_pool::idle_bytes() {
+    std::lock_guard<std::mutex> lock{all_mtx};
+    size_t n = 0;
+    for (auto *l: all) {
+        n += l->idle.load(std::memory_order_relaxed);
+    }
+    return n;
+}
+
+}
@@ -0,0 +1,37 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+
+namespace mole {
+
+// Thread-local free lists of relay buffers, one per buffer size in use, keeping a bounded
+// amount of idle memory per thread. Sessions borrow a buffer only while bytes are in flight
+// and give it back right after, so an idle connection holds none.
+class buffer_pool {
+public:
+    // room for the frame header and tag around a chunk of relayed bytes
+    static constexpr size_t HEADROOM = 128;
+    static constexpr size_t BLOCK_SIZE = 1024 * 32 + HEADROOM;
+
+    struct deleter {
+        size_t size;
+
+        void operator()(uint8_t *block) const {
+            release(block, size);
+        }
+    };
+    using buffer = std::unique_ptr<uint8_t[], deleter>;
+
+    static buffer acquire(size_t size = BLOCK_SIZE);
+
+    // bytes kept idle in the free lists of all threads, for benchmarks to tell them apart
+    // from what connections hold
+    static size_t idle_bytes();
+
+private:
+    static void release(uint8_t *block, size_t size);
+};
+
+}
@@ -0,0 +1,126 @@
+#include "connector.hpp"
+
+namespace mole {
+
+connector::connector(const tcp::socket::executor_type& ex, std::chrono::milliseconds delay,
+    std::chrono::milliseconds timeout):
+    executor_{ex}, delay_{delay}, timeout_{timeout}, delay_timer_{ex}, running_{0} {
+}
+
+void connector::start(const std::vector<tcp::endpoint>& endpoints, handler h) {
+    endpoints_ = interleave(endpoints);
+    handler_ = std::move(h);
+    error_ = asio::error::host_not_found;
+    if (endpoints_.empty()) {
+        // h never runs inside start(), the caller may still be setting up around it
+        auto self = shared_from_this();
+        asio::post(executor_, [this, self]() {
+            next();
+        });
+        return;
+    }
+    next();
+}
+
+void connector::cancel() {
+    // the handler may hold the last reference to its owner, whose teardown cancels again; it is
+    // destroyed only on the way out, once handler_ is empty
+    auto h = std::move(handler_);
+    handler_ = nullptr;
+    delay_timer_.cancel();
+    std::error_code ec;
+    for (auto& a: attempts_) {
+        a->timer.cancel();
+        a->socket.close(ec);
+    }
+}
+
+std::vector<tcp::endpoint> connector::interleave(const std::vector<tcp::endpoint>& endpoints) {
+    if (endpoints.empty()) {
+        return {};
+    }
+    auto first = endpoints.front().protocol();
+    std::vector<tcp::endpoint> same;
+    std::vector<tcp::endpoint> other;
+    for (auto& ep: endpoints) {
+        (ep.protocol() == first ? same : other).push_back(ep);
+    }
+    std::vector<tcp::endpoint> rr;
+    rr.reserve(endpoints.size());
+    for (size_t i = 0; i < std::max(same.size(), other.size()); ++i) {
+        if (i < same.size()) {
+            rr.push_back(same[i]);
+        }
+        if (i < other.size()) {
+            rr.push_back(other[i]);
+        }
+    }
+    return rr;
+}
+
+void connector::next() {
+    if (!handler_) {
+        return;
+    }
+    if (attempts_.size() >= endpoints_.size()) {
+        if (running_ == 0) {
+            auto h = std::move(handler_);
+            h(error_, tcp::socket{executor_});
+        }
+        return;
+    }
+    auto index = attempts_.size();
+    auto&& ep = endpoints_[index];
+    attempts_.push_back(std::unique_ptr<attempt>(new attempt{tcp::socket{executor_}, asio::steady_timer{executor_, timeout_}, false}));
+    auto& a = *attempts_.back();
+    ++running_;
+    spdlog::debug("connect attempt {}: {}", index, ep.address().to_string());
+
+    auto self = shared_from_this();
+    a.socket.async_connect(ep, [this, self, index](const std::error_code& ec) {
+        finish(index, ec);
+    });
+    a.timer.async_wait([this, self, index](const std::error_code& ec) {
+        if (!ec) {
+            finish(index, asio::error::timed_out);
+        }
+    });
+
+    if (attempts_.size() < endpoints_.size()) {
+        delay_timer_.expires_after(delay_);
+        delay_timer_.async_wait([this, self](const std::error_code& ec) {
+            if (!ec) {
+                next();
+            }
+        });
+    }
+}
+
+void connector::finish(size_t index, const std::error_code& ec) {
+    auto& a = *attempts_[index];
+    if (a.done) {
+        return;
+    }
+    a.done = true;
+    --running_;
+    a.timer.cancel();
+    if (!handler_) {
+        return;
+    }
+    if (!ec) {
+        auto h = std::move(handler_);
+        auto socket = std::move(a.socket);
+        cancel();
+        h(ec, std::move(socket));
+        return;
+    }
+    spdlog::debug("connect attempt {} error: {}", index, ec.message());
+    std::error_code cec;
+    a.socket.close(cec);
+    error_ = ec;
+    // a failed attempt does not wait out the delay
+    delay_timer_.cancel();
+    next();
+}
+
+}
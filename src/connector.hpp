@@ -0,0 +1,54 @@
+#pragma once
+
+#include "utils.hpp"
+
+namespace mole {
+
+using asio::ip::tcp;
+
+// Happy Eyeballs (RFC 8305) connect to the resolved addresses of a target. Attempts start one
+// delay apart, alternating address families, and the next one starts at once when one fails;
+// the first to connect wins and the others are closed. A blackholed address so costs the delay
+// instead of the kernel's SYN timeout, and each attempt gives up after its own timeout.
+class connector: public std::enable_shared_from_this<connector> {
+public:
+    using handler = std::function<void(const std::error_code&, tcp::socket&&)>;
+
+    connector(const tcp::socket::executor_type& ex, std::chrono::milliseconds delay, std::chrono::milliseconds timeout);
+
+    connector(const connector&) = delete;
+    connector(connector&&) = delete;
+
+    // h gets the connected socket, or the error of the last attempt once all failed; it is
+    // never called from within start()
+    void start(const std::vector<tcp::endpoint>& endpoints, handler h);
+
+    // closes every attempt, h is not called any more
+    void cancel();
+
+    // resolver order, with the families interleaved starting from that of the first address
+    static std::vector<tcp::endpoint> interleave(const std::vector<tcp::endpoint>& endpoints);
+
+private:
+    struct attempt {
+        tcp::socket socket;
+        asio::steady_timer timer;
+        bool done;
+    };
+
+    void next();
+    void finish(size_t index, const std::error_code& ec);
+
+    tcp::socket::executor_type executor_;
+    std::chrono::milliseconds delay_;
+    std::chrono::milliseconds timeout_;
+    asio::steady_timer delay_timer_;
+
+    std::vector<tcp::endpoint> endpoints_;
+    std::vector<std::unique_ptr<attempt>> attempts_;
+    size_t running_;
+    std::error_code error_;
+    handler handler_;
+};
+
+}
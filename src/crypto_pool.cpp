@@ -0,0 +1,25 @@
+#include "crypto_pool.hpp"
+
+namespace mole {
+
+crypto_pool& crypto_pool::self() {
+    static crypto_pool pool;
+    return pool;
+}
+
+void crypto_pool::start(size_t threads) {
+    if (threads == 0 || pool_) {
+        return;
+    }
+    pool_ = std::make_unique<asio::thread_pool>(threads);
+}
+
+void crypto_pool::stop() {
+    if (!pool_) {
+        return;
+    }
+    pool_->join();
+    pool_.reset();
+}
+
+}
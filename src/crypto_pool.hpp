@@ -0,0 +1,48 @@
+#pragma once
+
+#include "utils.hpp"
+
+namespace mole {
+
+// Optional worker threads for the AEAD work of large frames. A single bulk flow is otherwise
+// bound to the speed of the one thread running its session; with the pool its frames are
+// sealed and opened in parallel while the session keeps them in order for writing.
+// Small frames stay inline, a round trip through the pool costs more than they do.
+class crypto_pool {
+public:
+    static crypto_pool& self();
+
+    crypto_pool(const crypto_pool&) = delete;
+    crypto_pool(crypto_pool&&) = delete;
+
+    // no threads keeps everything inline
+    void start(size_t threads);
+    void stop();
+
+    // whether a frame of this many plaintext bytes goes to the pool, both directions judge a
+    // frame by its plaintext so it is handled alike on both ends
+    bool offload(size_t size) const {
+        return pool_ != nullptr && size >= OFFLOAD_MIN;
+    }
+
+    // runs job() on a worker, then done(result of job) on the session's executor
+    template<typename Executor, typename Job, typename Done>
+    void post(const Executor& ex, Job job, Done done) {
+        asio::post(*pool_, [ex, job = std::move(job), done = std::move(done)]() mutable {
+            auto ok = job();
+            // done holds the session, it must go back with it so the session is released there
+            asio::post(ex, [ok, done = std::move(done)]() mutable {
+                done(ok);
+            });
+        });
+    }
+
+private:
+    crypto_pool() = default;
+
+    static constexpr size_t OFFLOAD_MIN = 1024 * 16;
+
+    std::unique_ptr<asio::thread_pool> pool_;
+};
+
+}
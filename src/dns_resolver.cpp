@@ -0,0 +1,484 @@
+#include <sodium.h>
+
+#include <fstream>
+#include <sstream>
+
+#include "dns_resolver.hpp"
+
+namespace mole {
+
+namespace {
+
+uint16_t get16(const uint8_t *p) {
+    return static_cast<uint16_t>(p[0] << 8u | p[1]);
+}
+
+uint32_t get32(const uint8_t *p) {
+    return static_cast<uint32_t>(p[0]) << 24u | static_cast<uint32_t>(p[1]) << 16u |
+        static_cast<uint32_t>(p[2]) << 8u | p[3];
+}
+
+void put16(std::vector<uint8_t>& v, uint16_t x) {
+    v.push_back(static_cast<uint8_t>(x >> 8u));
+    v.push_back(static_cast<uint8_t>(x & 0xffu));
+}
+
+uint8_t lower(uint8_t c) {
+    return c >= 'A' && c <= 'Z' ? static_cast<uint8_t>(c - 'A' + 'a') : c;
+}
+
+// moves p past the name at p, compressed or not
+bool skip_name(const uint8_t *data, size_t size, size_t& p) {
+    while (p < size) {
+        auto len = data[p];
+        if (len == 0) {
+            p += 1;
+            return true;
+        }
+        if ((len & 0xc0u) == 0xc0u) {
+            p += 2;
+            return p <= size;
+        }
+        if ((len & 0xc0u) != 0) {
+            return false;
+        }
+        p += 1 + len;
+    }
+    return false;
+}
+
+}
+
+// one question, A or AAAA, until it has an answer or ran out of tries
+struct dns_resolver::query {
+    explicit query(asio::io_context& ctx): timer{ctx} {}
+
+    uint16_t type = 0;
+    uint16_t id = 0;
+    std::vector<uint8_t> packet;
+    // name, type and class, the part an answer repeats
+    size_t question_size = 0;
+    size_t tries = 0;
+    udp::endpoint server;
+    // the socket of the current try over UDP
+    std::shared_ptr<channel> udp_channel;
+    asio::steady_timer timer;
+    // set while the answer comes over TCP
+    std::shared_ptr<tcp::socket> stream;
+    std::vector<uint8_t> tcp_buff;
+    bool finished = false;
+    std::function<void(const std::error_code&, const address_vector&, uint32_t)> done;
+};
+
+// the A and the AAAA query of one resolve
+struct dns_resolver::lookup {
+    handler h;
+    size_t remaining = 2;
+    address_vector v6;
+    address_vector v4;
+    uint32_t ttl = UINT32_MAX;
+    std::error_code ec6;
+    std::error_code ec4;
+};
+
+dns_resolver::dns_resolver(asio::io_context& ctx):
+    asio::execution_context::service{ctx}, ctx_{ctx}, shutdown_{false} {
+}
+
+void dns_resolver::shutdown() {
+    shutdown_ = true;
+    std::error_code ec;
+    for (auto& kv: pending_) {
+        kv.second->timer.cancel();
+        if (kv.second->udp_channel) {
+            kv.second->udp_channel->socket.close(ec);
+        }
+        if (kv.second->stream) {
+            kv.second->stream->close(ec);
+        }
+    }
+    pending_.clear();
+}
+
+std::vector<asio::ip::udp::endpoint> dns_resolver::system_nameservers() {
+    std::vector<udp::endpoint> rr;
+    std::ifstream ifs{"/etc/resolv.conf"};
+    std::string line;
+    while (std::getline(ifs, line)) {
+        std::istringstream ss{line};
+        std::string key;
+        std::string value;
+        if (!(ss >> key >> value) || key != "nameserver") {
+            continue;
+        }
+        // a scope id is not supported, fe80::1%eth0
+        std::error_code ec;
+        auto ip = asio::ip::make_address(value, ec);
+        if (!ec) {
+            rr.emplace_back(ip, 53);
+        }
+    }
+    return rr;
+}
+
+void dns_resolver::resolve(const std::string& name, handler h) {
+    auto ttl = std::chrono::seconds(mole_cfg::self().dns_ttl());
+    // literals and localhost (RFC 6761) never go to the nameservers
+    std::error_code ec;
+    auto ip = asio::ip::make_address(name, ec);
+    if (!ec) {
+        asio::post(ctx_, [h = std::move(h), ip, ttl]() {
+            h({}, {ip}, ttl);
+        });
+        return;
+    }
+    std::string lname;
+    for (auto c: name) {
+        lname.push_back(static_cast<char>(lower(static_cast<uint8_t>(c))));
+    }
+    if (lname == "localhost" || lname == "localhost.") {
+        asio::post(ctx_, [h = std::move(h), ttl]() {
+            h({}, {asio::ip::address_v6::loopback(), asio::ip::address_v4::loopback()}, ttl);
+        });
+        return;
+    }
+
+    auto l = std::make_shared<lookup>();
+    l->h = std::move(h);
+    auto done = [l](bool v6) {
+        return [l, v6](const std::error_code& ec, const address_vector& addrs, uint32_t ttl) {
+            (v6 ? l->ec6 : l->ec4) = ec;
+            auto& v = v6 ? l->v6 : l->v4;
+            v.insert(v.end(), addrs.begin(), addrs.end());
+            if (!addrs.empty()) {
+                l->ttl = std::min(l->ttl, ttl);
+            }
+            if (--l->remaining > 0) {
+                return;
+            }
+            auto all = std::move(l->v6);
+            all.insert(all.end(), l->v4.begin(), l->v4.end());
+            if (!all.empty()) {
+                l->h({}, all, std::chrono::seconds(l->ttl));
+                return;
+            }
+            std::error_code rec = asio::error::host_not_found_try_again;
+            if (l->ec6 == asio::error::host_not_found || l->ec4 == asio::error::host_not_found) {
+                rec = asio::error::host_not_found;
+            } else if (l->ec6 == asio::error::no_data && l->ec4 == asio::error::no_data) {
+                rec = asio::error::no_data;
+            }
+            l->h(rec, {}, std::chrono::seconds(0));
+        };
+    };
+    start(name, TYPE_AAAA, done(true));
+    start(name, TYPE_A, done(false));
+}
+
+void dns_resolver::start(const std::string& name, uint16_t type,
+    std::function<void(const std::error_code&, const address_vector&, uint32_t)> done) {
+    auto q = std::make_shared<query>(ctx_);
+    q->type = type;
+    q->done = std::move(done);
+    if (pending_.size() >= 0x10000 / 2) {
+        spdlog::warn("too many dns queries in flight");
+        asio::post(ctx_, [this, q]() {
+            complete(q, asio::error::host_not_found_try_again, {}, 0);
+        });
+        return;
+    }
+    do {
+        q->id = static_cast<uint16_t>(randombytes_uniform(0x10000));
+    } while (pending_.count(q->id) > 0);
+    if (!encode(name, type, q->id, q->packet)) {
+        asio::post(ctx_, [this, q]() {
+            complete(q, asio::error::host_not_found, {}, 0);
+        });
+        return;
+    }
+    // header and OPT record excluded
+    q->question_size = q->packet.size() - 12 - 11;
+    pending_[q->id] = q;
+    transmit(q);
+}
+
+void dns_resolver::transmit(const std::shared_ptr<query>& q) {
+    auto& cfg = mole_cfg::self();
+    auto& ns = cfg.nameservers();
+    if (shutdown_ || q->finished) {
+        return;
+    }
+    if (ns.empty() || q->tries >= ns.size() * std::max<size_t>(cfg.dns_attempts(), 1)) {
+        complete(q, asio::error::host_not_found_try_again, {}, 0);
+        return;
+    }
+    // the first nameserver first, the others when it does not answer
+    q->server = ns[q->tries % ns.size()];
+    ++q->tries;
+    if (q->udp_channel) {
+        std::error_code ec;
+        q->udp_channel->socket.close(ec);
+    }
+    q->udp_channel = open_channel(q->server.protocol());
+    if (!q->udp_channel) {
+        transmit(q);
+        return;
+    }
+    receive(q, q->udp_channel);
+    // a lost or failed send is a timeout like a lost answer
+    q->udp_channel->socket.async_send_to(asio::buffer(q->packet), q->server, [q](const std::error_code&, size_t) {});
+    q->timer.expires_after(std::chrono::milliseconds(cfg.dns_timeout()));
+    q->timer.async_wait([this, q](const std::error_code& ec) {
+        if (ec || shutdown_ || q->finished) {
+            return;
+        }
+        spdlog::debug("dns query {} to {} timed out", q->id, q->server.address().to_string());
+        if (q->stream) {
+            std::error_code cec;
+            q->stream->close(cec);
+            q->stream.reset();
+        }
+        transmit(q);
+    });
+}
+
+std::shared_ptr<dns_resolver::channel> dns_resolver::open_channel(const udp& protocol) {
+    auto ch = std::make_shared<channel>(ctx_);
+    std::error_code ec;
+    ch->socket.open(protocol, ec);
+    // above the privileged ports, the kernel picks one if none of the tries is free
+    for (size_t i = 0; !ec && i < 8; ++i) {
+        auto port = static_cast<uint16_t>(1024 + randombytes_uniform(0x10000 - 1024));
+        ch->socket.bind({protocol, port}, ec);
+        if (!ec) {
+            return ch;
+        }
+        ec.clear();
+    }
+    if (!ec) {
+        ch->socket.bind({protocol, 0}, ec);
+    }
+    if (ec) {
+        spdlog::warn("dns socket error: {}", ec.message());
+        return nullptr;
+    }
+    return ch;
+}
+
+void dns_resolver::receive(const std::shared_ptr<query>& q, const std::shared_ptr<channel>& ch) {
+    ch->socket.async_receive_from(asio::buffer(ch->buff), ch->from, [this, q, ch](const std::error_code& ec, size_t sz) {
+        // closed once the query finished or moved on to another try
+        if (shutdown_ || q->finished || q->udp_channel != ch || ec == asio::error::operation_aborted) {
+            return;
+        }
+        // only from the address and port asked, and not once it went over to TCP
+        if (!ec && !q->stream && ch->from == q->server) {
+            answer(q, ch->buff.data(), sz);
+        }
+        if (!q->finished && q->udp_channel == ch) {
+            receive(q, ch);
+        }
+    });
+}
+
+void dns_resolver::answer(const std::shared_ptr<query>& q, const uint8_t *data, size_t size) {
+    bool truncated = false;
+    address_vector addrs;
+    uint32_t ttl = 0;
+    auto rcode = decode(*q, data, size, truncated, addrs, ttl);
+    if (rcode < 0) {
+        // not an answer to this query, keep waiting
+        return;
+    }
+    if (truncated && !q->stream) {
+        tcp_fallback(q);
+        return;
+    }
+    switch (rcode) {
+    case 0:
+        complete(q, addrs.empty() ? std::error_code{asio::error::no_data} : std::error_code{}, addrs, ttl);
+        break;
+    case 3: // NXDOMAIN
+        complete(q, asio::error::host_not_found, {}, 0);
+        break;
+    default:
+        // SERVFAIL, REFUSED and the like, the next nameserver may do better
+        spdlog::debug("dns query {} rcode {}", q->id, rcode);
+        if (q->stream) {
+            std::error_code ec;
+            q->stream->close(ec);
+            q->stream.reset();
+        }
+        transmit(q);
+        break;
+    }
+}
+
+void dns_resolver::tcp_fallback(const std::shared_ptr<query>& q) {
+    spdlog::debug("dns query {} truncated, over tcp", q->id);
+    auto sock = std::make_shared<tcp::socket>(ctx_);
+    q->stream = sock;
+    q->tcp_buff.clear();
+    put16(q->tcp_buff, static_cast<uint16_t>(q->packet.size()));
+    q->tcp_buff.insert(q->tcp_buff.end(), q->packet.begin(), q->packet.end());
+    q->timer.expires_after(std::chrono::milliseconds(mole_cfg::self().dns_timeout()));
+    q->timer.async_wait([this, q, sock](const std::error_code& ec) {
+        if (ec || shutdown_ || q->finished || q->stream != sock) {
+            return;
+        }
+        std::error_code cec;
+        sock->close(cec);
+        q->stream.reset();
+        transmit(q);
+    });
+
+    // true while this connection is still the one of the query
+    auto current = [this, q, sock](const std::error_code& ec) {
+        if (shutdown_ || q->finished || q->stream != sock) {
+            return false;
+        }
+        if (ec) {
+            spdlog::debug("dns query {} tcp error: {}", q->id, ec.message());
+            std::error_code cec;
+            sock->close(cec);
+            q->stream.reset();
+            transmit(q);
+            return false;
+        }
+        return true;
+    };
+    sock->async_connect({q->server.address(), q->server.port()}, [this, q, sock, current](const std::error_code& ec) {
+        if (!current(ec)) {
+            return;
+        }
+        asio::async_write(*sock, asio::buffer(q->tcp_buff), [this, q, sock, current](const std::error_code& ec, size_t) {
+            if (!current(ec)) {
+                return;
+            }
+            q->tcp_buff.resize(2);
+            asio::async_read(*sock, asio::buffer(q->tcp_buff), [this, q, sock, current](const std::error_code& ec, size_t) {
+                if (!current(ec)) {
+                    return;
+                }
+                q->tcp_buff.resize(get16(q->tcp_buff.data()));
+                asio::async_read(*sock, asio::buffer(q->tcp_buff), [this, q, sock, current](const std::error_code& ec, size_t) {
+                    if (!current(ec)) {
+                        return;
+                    }
+                    answer(q, q->tcp_buff.data(), q->tcp_buff.size());
+                });
+            });
+        });
+    });
+}
+
+void dns_resolver::complete(const std::shared_ptr<query>& q, const std::error_code& ec, const address_vector& addrs,
+    uint32_t ttl) {
+    if (q->finished) {
+        return;
+    }
+    q->finished = true;
+    auto it = pending_.find(q->id);
+    if (it != pending_.end() && it->second == q) {
+        pending_.erase(it);
+    }
+    q->timer.cancel();
+    std::error_code cec;
+    if (q->udp_channel) {
+        q->udp_channel->socket.close(cec);
+        q->udp_channel.reset();
+    }
+    if (q->stream) {
+        q->stream->close(cec);
+        q->stream.reset();
+    }
+    auto done = std::move(q->done);
+    done(ec, addrs, ttl);
+}
+
+bool dns_resolver::encode(const std::string& name, uint16_t type, uint16_t id, std::vector<uint8_t>& packet) {
+    auto n = name;
+    if (!n.empty() && n.back() == '.') {
+        n.pop_back();
+    }
+    if (n.empty() || n.size() > 253) {
+        return false;
+    }
+    packet.clear();
+    put16(packet, id);
+    // recursion desired, one question, the OPT record
+    packet.insert(packet.end(), {0x01, 0x00, 0x00, 0x01, 0x00, 0x00, 0x00, 0x00, 0x00, 0x01});
+    size_t p = 0;
+    while (p <= n.size()) {
+        auto q = n.find('.', p);
+        if (q == std::string::npos) {
+            q = n.size();
+        }
+        auto len = q - p;
+        if (len == 0 || len > 63) {
+            return false;
+        }
+        packet.push_back(static_cast<uint8_t>(len));
+        packet.insert(packet.end(), n.begin() + static_cast<std::ptrdiff_t>(p), n.begin() + static_cast<std::ptrdiff_t>(q));
+        p = q + 1;
+    }
+    packet.push_back(0);
+    put16(packet, type);
+    put16(packet, 1); // IN
+    // EDNS0: root, OPT, our UDP payload size, no extended rcode, version 0, no flags, no options
+    packet.push_back(0);
+    put16(packet, TYPE_OPT);
+    put16(packet, MAX_UDP_SIZE);
+    packet.insert(packet.end(), {0x00, 0x00, 0x00, 0x00, 0x00, 0x00});
+    return true;
+}
+
+int dns_resolver::decode(const query& q, const uint8_t *data, size_t size, bool& truncated, address_vector& addrs,
+    uint32_t& ttl) {
+    if (size < 12 + q.question_size || get16(data) != q.id || !(data[2] & 0x80u) || get16(data + 4) != 1) {
+        return -1;
+    }
+    // the question must be ours, names compare without case
+    for (size_t i = 0; i < q.question_size; ++i) {
+        if (lower(data[12 + i]) != lower(q.packet[12 + i])) {
+            return -1;
+        }
+    }
+    truncated = (data[2] & 0x02u) != 0;
+    auto rcode = data[3] & 0x0fu;
+    auto an = get16(data + 6);
+    size_t p = 12 + q.question_size;
+    uint32_t min_ttl = UINT32_MAX;
+    for (size_t i = 0; i < an; ++i) {
+        if (!skip_name(data, size, p) || p + 10 > size) {
+            return -1;
+        }
+        auto type = get16(data + p);
+        auto cls = get16(data + p + 2);
+        auto rttl = get32(data + p + 4);
+        size_t rdlen = get16(data + p + 8);
+        p += 10;
+        if (p + rdlen > size) {
+            return -1;
+        }
+        // records of the CNAME chain count for the TTL too
+        if (cls == 1 && type == q.type && type == TYPE_A && rdlen == 4) {
+            addrs.emplace_back(asio::ip::address_v4{{data[p], data[p + 1], data[p + 2], data[p + 3]}});
+            min_ttl = std::min(min_ttl, rttl);
+        } else if (cls == 1 && type == q.type && type == TYPE_AAAA && rdlen == 16) {
+            asio::ip::address_v6::bytes_type bytes;
+            std::copy(data + p, data + p + 16, bytes.begin());
+            addrs.emplace_back(asio::ip::address_v6{bytes});
+            min_ttl = std::min(min_ttl, rttl);
+        } else if (cls == 1 && type == TYPE_CNAME) {
+            min_ttl = std::min(min_ttl, rttl);
+        }
+        p += rdlen;
+    }
+    auto& cfg = mole_cfg::self();
+    ttl = addrs.empty() ? 0 : static_cast<uint32_t>(std::min<size_t>(std::max<size_t>(min_ttl, cfg.dns_min_ttl()),
+        cfg.dns_max_ttl()));
+    return static_cast<int>(rcode);
+}
+
+}
@@ -0,0 +1,92 @@
+#pragma once
+
+#include <unordered_map>
+
+#include "utils.hpp"
+
+namespace mole {
+
+// DNS stub on the io_context of the sessions, used by the remote instead of getaddrinfo when
+// nameservers are configured. asio runs getaddrinfo on one hidden thread, so there a slow
+// name holds up every lookup behind it; here all lookups are in flight together.
+// A and AAAA are asked in parallel over UDP, with EDNS0 for answers up to 1232 bytes and TCP
+// when an answer is truncated anyway. Tries go round the nameservers, each waiting for its
+// timeout. Every try goes out from a fresh socket on a random port and only an answer from
+// the nameserver asked, address and port, is taken, so a spoofed answer has to guess the port
+// as well as the id. Answers carry the TTL of their records, kept within dns_min_ttl and
+// dns_max_ttl. Registered as an asio service like session_pool, only touched from the thread
+// running the context.
+class dns_resolver: public asio::execution_context::service {
+public:
+    using key_type = dns_resolver;
+    inline static asio::execution_context::id id;
+
+    using udp = asio::ip::udp;
+    using tcp = asio::ip::tcp;
+    using address_vector = std::vector<asio::ip::address>;
+    // IPv6 addresses first, ttl is the smallest of the records used
+    using handler = std::function<void(const std::error_code&, const address_vector&, std::chrono::seconds ttl)>;
+
+    static constexpr uint16_t TYPE_A = 1;
+    static constexpr uint16_t TYPE_CNAME = 5;
+    static constexpr uint16_t TYPE_AAAA = 28;
+    static constexpr uint16_t TYPE_OPT = 41;
+    // the EDNS0 payload size that avoids fragmentation (DNS flag day 2020)
+    static constexpr size_t MAX_UDP_SIZE = 1232;
+
+    explicit dns_resolver(asio::io_context& ctx);
+    ~dns_resolver() override = default;
+
+    dns_resolver(const dns_resolver&) = delete;
+    dns_resolver(dns_resolver&&) = delete;
+
+    static dns_resolver& of(asio::io_context& ctx) {
+        return asio::use_service<dns_resolver>(ctx);
+    }
+
+    // without nameservers the remote resolves with getaddrinfo
+    static bool enabled() {
+        return !mole_cfg::self().nameservers().empty();
+    }
+
+    // the nameserver lines of /etc/resolv.conf
+    static std::vector<udp::endpoint> system_nameservers();
+
+    void resolve(const std::string& name, handler h);
+
+private:
+    struct query;
+    struct lookup;
+
+    struct channel {
+        explicit channel(asio::io_context& ctx): socket{ctx} {}
+
+        udp::socket socket;
+        udp::endpoint from;
+        std::array<uint8_t, MAX_UDP_SIZE> buff{};
+    };
+
+    void shutdown() override;
+
+    void start(const std::string& name, uint16_t type,
+        std::function<void(const std::error_code&, const address_vector&, uint32_t)> done);
+    void transmit(const std::shared_ptr<query>& q);
+    // a UDP socket bound to a random port, null if none could be opened
+    std::shared_ptr<channel> open_channel(const udp& protocol);
+    void receive(const std::shared_ptr<query>& q, const std::shared_ptr<channel>& ch);
+    void answer(const std::shared_ptr<query>& q, const uint8_t *data, size_t size);
+    void tcp_fallback(const std::shared_ptr<query>& q);
+    void complete(const std::shared_ptr<query>& q, const std::error_code& ec, const address_vector& addrs, uint32_t ttl);
+
+    static bool encode(const std::string& name, uint16_t type, uint16_t id, std::vector<uint8_t>& packet);
+    // the rcode of an answer to q, -1 when it is not one
+    static int decode(const query& q, const uint8_t *data, size_t size, bool& truncated, address_vector& addrs,
+        uint32_t& ttl);
+
+    asio::io_context& ctx_;
+    bool shutdown_;
+    size_t next_server_;
+    std::unordered_map<uint16_t, std::shared_ptr<query>> pending_;
+};
+
+}
@@ -0,0 +1,342 @@
+#include <cstring>
+#include <fstream>
+#include <sstream>
+
+#include "domain_cache.hpp"
+
+namespace mole {
+
+domain_cache& domain_cache::self() {
+    static domain_cache cache;
+    return cache;
+}
+
+bool domain_cache::valid(std::string_view name) {
+    if (name.empty()) {
+        return false;
+    }
+    // a snapshot line is split on whitespace, a name must not break it
+    for (auto c: name) {
+        auto u = static_cast<unsigned char>(c);
+        if (u <= 0x20 || u == 0x7f) {
+            return false;
+        }
+    }
+    return true;
+}
+
+std::string domain_cache::key(const std::string& domain) {
+    auto k = domain;
+    for (auto& c: k) {
+        if (c >= 'A' && c <= 'Z') {
+            c = static_cast<char>(c - 'A' + 'a');
+        }
+    }
+    return k;
+}
+
+domain_cache::status domain_cache::query(const std::string& domain, endpoint_vector& endpoints, const executor& ex,
+    waiter w) {
+    auto k = key(domain);
+    auto& s = shard_of(k);
+    auto now = clock::now();
+    auto stale = std::chrono::seconds(mole_cfg::self().dns_stale());
+    std::lock_guard<std::mutex> lock{s.mtx};
+    auto& it = slot(s, k, now);
+    it.used = true;
+    if (it.expires > now) {
+        if (it.count == 0) {
+            return status::negative;
+        }
+        endpoints = endpoints_of(it);
+        // hot names are renewed in the last eighth of their TTL, one second at least
+        auto ahead = std::max<clock::duration>(it.ttl / 8, std::chrono::seconds(1));
+        if (++it.hits >= HOT_HITS && !it.resolving && now + ahead >= it.expires) {
+            it.resolving = true;
+            return status::refresh;
+        }
+        return status::hit;
+    }
+    if (it.count > 0 && now < it.expires + stale) {
+        // expired but not for long, served while the one refresh runs
+        endpoints = endpoints_of(it);
+        if (it.resolving) {
+            return status::hit;
+        }
+        it.resolving = true;
+        return status::refresh;
+    }
+    if (it.resolving) {
+        it.waiters.emplace_back(ex, std::move(w));
+        return status::wait;
+    }
+    it.resolving = true;
+    return status::resolve;
+}
+
+void domain_cache::set(const std::string& domain, const endpoint_vector& endpoints, std::chrono::seconds ttl) {
+    finish(domain, {}, endpoints, ttl);
+}
+
+void domain_cache::fail(const std::string& domain, const std::error_code& ec, bool negative) {
+    auto ttl = negative ? std::chrono::seconds(mole_cfg::self().dns_negative_ttl()) : std::chrono::seconds(0);
+    finish(domain, ec, {}, ttl);
+}
+
+void domain_cache::finish(const std::string& domain, const std::error_code& ec, const endpoint_vector& endpoints,
+    clock::duration ttl) {
+    auto k = key(domain);
+    auto& s = shard_of(k);
+    auto now = clock::now();
+    auto stale = std::chrono::seconds(mole_cfg::self().dns_stale());
+    std::vector<std::pair<executor, waiter>> waiters;
+    {
+        std::lock_guard<std::mutex> lock{s.mtx};
+        auto& it = slot(s, k, now);
+        it.resolving = false;
+        waiters.swap(it.waiters);
+        if (ec && it.count > 0 && now < it.expires + stale) {
+            // a failed refresh keeps what the name had
+        } else if (ttl <= clock::duration::zero() && (endpoints.empty() || stale == clock::duration::zero())) {
+            release(s, s.index.find(k)->second);
+        } else {
+            store(s, it, endpoints);
+            it.expires = now + ttl;
+            it.ttl = ttl;
+            it.hits = 0;
+        }
+    }
+    // each waiter goes back to the thread of its session
+    for (auto& w: waiters) {
+        asio::post(w.first, [ec, endpoints, cb = std::move(w.second)]() {
+            cb(ec, endpoints);
+        });
+    }
+}
+
+domain_cache::endpoint_vector domain_cache::get(const std::string& domain) {
+    auto k = key(domain);
+    auto& s = shard_of(k);
+    std::lock_guard<std::mutex> lock{s.mtx};
+    auto p = s.index.find(k);
+    if (p == s.index.end()) {
+        return {};
+    }
+    auto& it = s.slots[p->second];
+    if (it.resolving || it.expires <= clock::now()) {
+        return {};
+    }
+    it.used = true;
+    return endpoints_of(it);
+}
+
+domain_cache::usage domain_cache::stats() {
+    usage u{};
+    for (auto& s: shards_) {
+        std::lock_guard<std::mutex> lock{s.mtx};
+        u.entries += s.index.size();
+        u.evicted += s.evicted;
+        // a node of the index holds its value, the next pointer and the cached hash
+        u.bytes += s.slots.capacity() * sizeof(item) + s.free.capacity() * sizeof(uint32_t) +
+            s.index.bucket_count() * sizeof(void*) +
+            s.index.size() * (sizeof(std::pair<const std::string_view, uint32_t>) + 2 * sizeof(void*)) + s.heap;
+    }
+    return u;
+}
+
+bool domain_cache::save(const std::string& path) {
+    auto tmp = path + ".tmp";
+    std::ofstream ofs{tmp, std::ios::trunc};
+    if (!ofs) {
+        spdlog::error("can NOT write dns cache file {}", tmp);
+        return false;
+    }
+    auto now = clock::now();
+    auto wall = std::chrono::system_clock::now();
+    size_t n = 0;
+    for (auto& s: shards_) {
+        std::lock_guard<std::mutex> lock{s.mtx};
+        for (auto& it: s.slots) {
+            if (!it.live || it.count == 0 || !valid({it.name.get(), it.name_size})) {
+                continue;
+            }
+            auto expires = std::chrono::system_clock::to_time_t(
+                wall + std::chrono::duration_cast<std::chrono::system_clock::duration>(it.expires - now));
+            ofs << std::string_view{it.name.get(), it.name_size} << ' ' << expires << ' '
+                << std::chrono::duration_cast<std::chrono::seconds>(it.ttl).count();
+            for (auto& ep: endpoints_of(it)) {
+                ofs << ' ' << ep.address().to_string();
+            }
+            ofs << '\n';
+            ++n;
+        }
+    }
+    ofs.close();
+    if (!ofs || std::rename(tmp.c_str(), path.c_str()) != 0) {
+        spdlog::error("can NOT write dns cache file {}", path);
+        std::remove(tmp.c_str());
+        return false;
+    }
+    spdlog::info("{} names saved to {}", n, path);
+    return true;
+}
+
+bool domain_cache::load(const std::string& path) {
+    std::ifstream ifs{path};
+    if (!ifs) {
+        // nothing saved yet
+        spdlog::info("no dns cache file {}", path);
+        return false;
+    }
+    auto now = clock::now();
+    auto wall = std::chrono::system_clock::to_time_t(std::chrono::system_clock::now());
+    auto stale = static_cast<time_t>(mole_cfg::self().dns_stale());
+    auto max_ttl = static_cast<long>(mole_cfg::self().dns_max_ttl());
+    std::string line;
+    size_t n = 0;
+    while (std::getline(ifs, line)) {
+        std::istringstream iss{line};
+        std::string name, addr;
+        time_t expires = 0;
+        long ttl = 0;
+        if (!(iss >> name >> expires >> ttl) || !valid(name) || ttl < 0) {
+            continue;
+        }
+        // a name is never kept longer than it was resolved for
+        ttl = std::min(ttl, max_ttl);
+        expires = std::min(expires, wall + static_cast<time_t>(ttl));
+        if (expires <= wall - stale) {
+            continue;
+        }
+        endpoint_vector endpoints;
+        while (iss >> addr) {
+            std::error_code ec;
+            auto ip = asio::ip::make_address(addr, ec);
+            if (!ec) {
+                endpoints.emplace_back(ip, 0);
+            }
+        }
+        if (endpoints.empty()) {
+            continue;
+        }
+        auto k = key(name);
+        auto& s = shard_of(k);
+        std::lock_guard<std::mutex> lock{s.mtx};
+        auto& it = slot(s, k, now);
+        if (it.resolving) {
+            continue;
+        }
+        store(s, it, endpoints);
+        it.expires = now + std::chrono::seconds(expires - wall);
+        it.ttl = std::chrono::seconds(ttl);
+        ++n;
+    }
+    spdlog::info("{} names loaded from {}", n, path);
+    return true;
+}
+
+domain_cache::item& domain_cache::slot(shard& s, const std::string& key, clock::time_point now) {
+    auto p = s.index.find(key);
+    if (p != s.index.end()) {
+        return s.slots[p->second];
+    }
+    auto& cfg = mole_cfg::self();
+    auto capacity = std::max<size_t>((cfg.dns_cache_size() + SHARDS - 1) / SHARDS, 1);
+    uint32_t i = NO_SLOT;
+    if (!s.free.empty()) {
+        i = s.free.back();
+        s.free.pop_back();
+    } else if (s.slots.size() >= capacity) {
+        i = evict(s, now);
+    }
+    if (i == NO_SLOT) {
+        // below capacity, or every entry is being resolved
+        i = static_cast<uint32_t>(s.slots.size());
+        s.slots.emplace_back();
+    }
+    auto& it = s.slots[i];
+    it.name_size = static_cast<uint16_t>(std::min<size_t>(key.size(), UINT16_MAX));
+    it.name = std::make_unique<char[]>(it.name_size);
+    std::memcpy(it.name.get(), key.data(), it.name_size);
+    it.live = true;
+    s.heap += it.name_size;
+    s.index.emplace(std::string_view{it.name.get(), it.name_size}, i);
+    return it;
+}
+
+uint32_t domain_cache::evict(shard& s, clock::time_point now) {
+    // second chance: an entry used since the hand last passed is kept for one more round,
+    // one that is past its stale window goes at once, one being resolved never
+    auto stale = std::chrono::seconds(mole_cfg::self().dns_stale());
+    for (size_t n = 0; n < 2 * s.slots.size(); ++n) {
+        auto i = static_cast<uint32_t>(s.hand);
+        s.hand = (s.hand + 1) % s.slots.size();
+        auto& it = s.slots[i];
+        if (!it.live || it.resolving) {
+            continue;
+        }
+        auto dead = now >= it.expires + (it.count > 0 ? stale : clock::duration::zero());
+        if (it.used && !dead) {
+            it.used = false;
+            continue;
+        }
+        release(s, i);
+        s.free.pop_back();
+        ++s.evicted;
+        return i;
+    }
+    return NO_SLOT;
+}
+
+void domain_cache::release(shard& s, uint32_t i) {
+    auto& it = s.slots[i];
+    s.index.erase(std::string_view{it.name.get(), it.name_size});
+    s.heap -= it.name_size + (it.more ? it.count * sizeof(packed_address) : 0);
+    it = item{};
+    s.free.push_back(i);
+}
+
+void domain_cache::store(shard& s, item& it, const endpoint_vector& endpoints) {
+    auto count = std::min(endpoints.size(), MAX_ADDRS);
+    if (it.more) {
+        s.heap -= it.count * sizeof(packed_address);
+        it.more.reset();
+    }
+    auto *out = it.addrs.data();
+    if (count > INLINE_ADDRS) {
+        it.more = std::make_unique<packed_address[]>(count);
+        out = it.more.get();
+        s.heap += count * sizeof(packed_address);
+    }
+    for (size_t i = 0; i < count; ++i) {
+        auto a = endpoints[i].address();
+        auto& p = out[i];
+        p.v6 = a.is_v6();
+        if (p.v6) {
+            p.bytes = a.to_v6().to_bytes();
+        } else {
+            auto b = a.to_v4().to_bytes();
+            std::memcpy(p.bytes.data(), b.data(), b.size());
+        }
+    }
+    it.count = static_cast<uint8_t>(count);
+}
+
+domain_cache::endpoint_vector domain_cache::endpoints_of(const item& it) {
+    endpoint_vector rr;
+    rr.reserve(it.count);
+    auto *in = it.more ? it.more.get() : it.addrs.data();
+    for (size_t i = 0; i < it.count; ++i) {
+        auto& p = in[i];
+        if (p.v6) {
+            rr.emplace_back(asio::ip::address_v6{p.bytes}, 0);
+        } else {
+            asio::ip::address_v4::bytes_type b;
+            std::memcpy(b.data(), p.bytes.data(), b.size());
+            rr.emplace_back(asio::ip::address_v4{b}, 0);
+        }
+    }
+    return rr;
+}
+
+}
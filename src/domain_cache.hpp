@@ -0,0 +1,136 @@
+#pragma once
+
+#include <array>
+#include <string_view>
+#include <unordered_map>
+
+#include "utils.hpp"
+
+namespace mole {
+
+// Resolved names shared by every connection thread. Shards keep the locks short and apart,
+// each record expires after its own TTL and failed lookups are remembered for a while too.
+// Lookups are coalesced: the first session asking for a name that is not cached resolves it,
+// the ones asking meanwhile are queued and called back on their own executor with the result.
+// Names asked for often are refreshed in the background shortly before they expire, and once
+// expired they are still served for a bounded while (RFC 8767) as long as a refresh is on its
+// way, so popular targets never wait for a lookup.
+// The cache holds at most dns_cache_size names. Each shard keeps its entries in a slot array
+// swept by a CLOCK hand, names not used since the last pass make room for new ones, so a
+// stream of one-off names can not grow it. Endpoints are kept as bare addresses, the first
+// few inline in the entry.
+class domain_cache {
+public:
+    static domain_cache& self();
+
+    domain_cache(const domain_cache&) = delete;
+    domain_cache(domain_cache&&) = delete;
+
+    // the endpoints handed out by query() and get() carry no port
+    using endpoint_vector = std::vector<asio::ip::tcp::endpoint>;
+    using executor = asio::ip::tcp::socket::executor_type;
+    using waiter = std::function<void(const std::error_code&, const endpoint_vector&)>;
+
+    enum class status {
+        hit,        // endpoints are filled in
+        refresh,    // endpoints are filled in, the caller also resolves the name again in the
+                    // background and hands the result to set() or fail()
+        negative,   // the name did not resolve a moment ago
+        resolve,    // the caller resolves it and hands the result to set() or fail()
+        wait,       // being resolved by another session, w is called back with its result
+    };
+
+    struct usage {
+        size_t entries;
+        size_t bytes;       // approximate, entries, names, addresses and the indexes
+        size_t evicted;     // since start
+    };
+
+    status query(const std::string& domain, endpoint_vector& endpoints, const executor& ex, waiter w);
+
+    // the result of a resolve, stored for ttl and passed to the queued waiters
+    void set(const std::string& domain, const endpoint_vector& endpoints, std::chrono::seconds ttl);
+    // negative: remembered for the negative TTL, otherwise nothing is stored and the next
+    // query resolves again; a name that has endpoints keeps serving them until its stale
+    // window is over
+    void fail(const std::string& domain, const std::error_code& ec, bool negative);
+
+    endpoint_vector get(const std::string& domain);
+
+    usage stats();
+
+    // no control characters nor whitespace, names with any are never resolved nor cached; '_' and
+    // the ':' of IPv6 literals are fine
+    static bool valid(std::string_view name);
+
+    // "name expires ttl address..." lines, expires in unix seconds, for the names that have
+    // endpoints; load() skips the ones past their stale window or not valid(), and keeps none
+    // longer than its TTL and dns_max_ttl allow
+    bool save(const std::string& path);
+    bool load(const std::string& path);
+
+private:
+    domain_cache() = default;
+
+    using clock = std::chrono::steady_clock;
+
+    // hits within a TTL that make a name worth refreshing ahead
+    static constexpr size_t HOT_HITS = 4;
+    // one A and one AAAA fit in the entry, more go to the heap
+    static constexpr size_t INLINE_ADDRS = 2;
+    // far more than Happy Eyeballs will ever try
+    static constexpr size_t MAX_ADDRS = 32;
+    static constexpr uint32_t NO_SLOT = UINT32_MAX;
+
+    // IPv4 in the first four bytes
+    struct packed_address {
+        std::array<uint8_t, 16> bytes;
+        bool v6;
+    };
+
+    struct item {
+        // the lowercased name, the index of the shard refers to it
+        std::unique_ptr<char[]> name;
+        std::unique_ptr<packed_address[]> more;     // all addresses, when there are too many inline
+        clock::time_point expires;
+        clock::duration ttl{};
+        std::vector<std::pair<executor, waiter>> waiters;
+        std::array<packed_address, INLINE_ADDRS> addrs;
+        uint32_t hits = 0;
+        uint16_t name_size = 0;
+        uint8_t count = 0;
+        bool live = false;
+        bool used = false;      // CLOCK reference bit
+        bool resolving = false;
+    };
+
+    struct shard {
+        std::mutex mtx;
+        std::vector<item> slots;
+        std::vector<uint32_t> free;
+        std::unordered_map<std::string_view, uint32_t> index;
+        size_t hand = 0;
+        size_t heap = 0;        // names and addresses out of the slots
+        size_t evicted = 0;
+    };
+
+    static constexpr size_t SHARDS = 16;
+
+    static std::string key(const std::string& domain);
+    shard& shard_of(const std::string& key) {
+        return shards_[std::hash<std::string>{}(key) % SHARDS];
+    }
+    void finish(const std::string& domain, const std::error_code& ec, const endpoint_vector& endpoints,
+        clock::duration ttl);
+
+    // the slot of key, a new entry when it has none
+    static item& slot(shard& s, const std::string& key, clock::time_point now);
+    static uint32_t evict(shard& s, clock::time_point now);
+    static void release(shard& s, uint32_t i);
+    static void store(shard& s, item& it, const endpoint_vector& endpoints);
+    static endpoint_vector endpoints_of(const item& it);
+
+    std::array<shard, SHARDS> shards_;
+};
+
+}
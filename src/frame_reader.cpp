@@ -0,0 +1,138 @@
+#include <cstring>
+
+#include "frame_reader.hpp"
+
+namespace mole {
+
+frame_reader::frame_reader(size_t capacity, size_t max_frame):
+    initial_capacity_{capacity}, initial_max_frame_{max_frame},
+    capacity_{capacity}, max_frame_{max_frame}, format_{frame_format::v1},
+    head_{0}, decoded_{0}, tail_{0}, mirror_end_{0} {
+}
+
+void frame_reader::configure(size_t capacity, size_t max_frame, frame_format fmt) {
+    auto old = std::move(storage_);
+    auto old_capacity = capacity_;
+    auto from = static_cast<size_t>(decoded_ % old_capacity);
+    auto n = static_cast<size_t>(tail_ - decoded_);
+
+    capacity_ = capacity;
+    max_frame_ = max_frame;
+    format_ = fmt;
+    head_ = 0;
+    decoded_ = 0;
+    tail_ = 0;
+    mirror_end_ = 0;
+    if (n > 0) {
+        auto first = std::min(n, old_capacity - from);
+        append(old.get() + from, first);
+        append(old.get(), n - first);
+    }
+}
+
+std::array<asio::mutable_buffer, 2> frame_reader::prepare() {
+    if (!storage_) {
+        storage_ = buffer_pool::acquire(capacity_ + max_frame_);
+    }
+    auto free = capacity_ - (tail_ - head_);
+    auto start = static_cast<size_t>(tail_ % capacity_);
+    auto first = std::min(free, capacity_ - start);
+    return {
+        asio::buffer(storage_.get() + start, first),
+        asio::buffer(storage_.get(), free - first),
+    };
+}
+
+void frame_reader::commit(size_t n) {
+    tail_ += n;
+}
+
+void frame_reader::append(const uint8_t *data, size_t n) {
+    auto bb = prepare();
+    auto first = std::min(n, bb[0].size());
+    std::memcpy(bb[0].data(), data, first);
+    std::memcpy(bb[1].data(), data + first, n - first);
+    commit(n);
+}
+
+bool frame_reader::header(size_t& len, size_t& hl) const {
+    auto avail = tail_ - decoded_;
+    if (format_ == frame_format::v1) {
+        if (avail < 2) {
+            return false;
+        }
+        len = static_cast<size_t>(at(decoded_) << 8u) | at(decoded_ + 1);
+        hl = 2;
+        return true;
+    }
+    len = 0;
+    for (size_t i = 0; i < FRAME_HEADER_MAX; ++i) {
+        if (avail <= i) {
+            return false;
+        }
+        auto b = at(decoded_ + i);
+        len |= static_cast<size_t>(b & 0x7fu) << (7 * i);
+        if (!(b & 0x80u)) {
+            hl = i + 1;
+            return true;
+        }
+    }
+    // longer than any header, fails the max_frame check
+    len = max_frame_;
+    hl = FRAME_HEADER_MAX;
+    return true;
+}
+
+frame_reader::result frame_reader::next(frame& f) {
+    size_t len = 0;
+    size_t hl = 0;
+    if (!header(len, hl)) {
+        return result::partial;
+    }
+    if (len + hl > max_frame_) {
+        return result::invalid;
+    }
+    if (tail_ - decoded_ < len + hl) {
+        return result::partial;
+    }
+
+    auto start = static_cast<size_t>((decoded_ + hl) % capacity_);
+    if (start + len > capacity_) {
+        if (mirror_end_ > head_) {
+            return result::blocked;
+        }
+        std::memcpy(storage_.get() + capacity_, storage_.get(), start + len - capacity_);
+        mirror_end_ = decoded_ + hl + len;
+    }
+    decoded_ += hl + len;
+    f = {storage_.get() + start, len, decoded_};
+    return result::frame;
+}
+
+void frame_reader::release(uint64_t end) {
+    head_ = end;
+}
+
+void frame_reader::shrink() {
+    if (!empty()) {
+        return;
+    }
+    storage_.reset();
+    head_ = 0;
+    decoded_ = 0;
+    tail_ = 0;
+    mirror_end_ = 0;
+}
+
+void frame_reader::reset() {
+    storage_.reset();
+    head_ = 0;
+    decoded_ = 0;
+    tail_ = 0;
+    mirror_end_ = 0;
+    capacity_ = initial_capacity_;
+    max_frame_ = initial_max_frame_;
+    format_ = frame_format::v1;
+}
+
+}
@@ -0,0 +1,85 @@
+#pragma once
+
+#include <array>
+
+#include "buffer_pool.hpp"
+#include "proto.hpp"
+#include "utils.hpp"
+
+namespace mole {
+
+// Receive side of the tunnel framing, [header][len bytes of ciphertext], shared by both
+// session types. The header format is the one from proto.hpp in effect for the connection.
+// Bytes are read into a ring and every complete frame already buffered is handed out in one
+// pass. Frames stay where they were received, so they can be decrypted in place, until they
+// are released in order once written. Nothing is ever shifted: a frame that wraps the end of
+// the ring gets its wrapped part copied into a slack area right behind the ring, which keeps
+// it contiguous.
+// The ring is borrowed from buffer_pool and can be given back with shrink() whenever it runs
+// empty and no read into it is outstanding.
+class frame_reader {
+public:
+    enum class result {
+        frame,
+        partial,    // more bytes needed
+        blocked,    // the slack area is still in use, wait for a release
+        invalid,
+    };
+
+    struct frame {
+        uint8_t *data;
+        size_t size;
+        uint64_t end;   // pass to release() once the frame is no longer needed
+    };
+
+    // capacity must hold at least one frame of max_frame bytes, header included
+    frame_reader(size_t capacity, size_t max_frame);
+
+    // switch to the framing agreed in the hello; no frame may be handed out at that point,
+    // bytes not yet decoded are kept
+    void configure(size_t capacity, size_t max_frame, frame_format fmt);
+
+    // nothing buffered and no frame handed out
+    bool empty() const {
+        return head_ == tail_;
+    }
+
+    bool full() const {
+        return tail_ - head_ == capacity_;
+    }
+
+    std::array<asio::mutable_buffer, 2> prepare();
+    void commit(size_t n);
+    void append(const uint8_t *data, size_t n);
+
+    result next(frame& f);
+    void release(uint64_t end);
+
+    void shrink();
+    void reset();
+
+private:
+    uint8_t at(uint64_t pos) const {
+        return storage_[pos % capacity_];
+    }
+
+    // length and header size of the frame at decoded_, false if the header is incomplete
+    bool header(size_t& len, size_t& hl) const;
+
+private:
+    const size_t initial_capacity_;
+    const size_t initial_max_frame_;
+    size_t capacity_;
+    size_t max_frame_;
+    frame_format format_;
+
+    buffer_pool::buffer storage_;
+
+    // positions grow monotonically: [head_, decoded_) handed out, [decoded_, tail_) not yet decoded
+    uint64_t head_;
+    uint64_t decoded_;
+    uint64_t tail_;
+    uint64_t mirror_end_;
+};
+
+}
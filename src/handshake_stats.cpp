@@ -0,0 +1,102 @@
+#include "handshake_stats.hpp"
+
+namespace mole {
+
+handshake_stats& handshake_stats::self() {
+    static handshake_stats stats;
+    return stats;
+}
+
+handshake_stats::handshake_stats(): enabled_{false} {
+    clear();
+}
+
+void handshake_stats::mark(phase p, clock::time_point& since) {
+    auto now = clock::now();
+    auto us = static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::microseconds>(now - since).count());
+    since = now;
+    buckets_[p][bucket(us)].fetch_add(1, std::memory_order_relaxed);
+    auto old = max_[p].load(std::memory_order_relaxed);
+    while (us > old && !max_[p].compare_exchange_weak(old, us, std::memory_order_relaxed)) {
+    }
+}
+
+void handshake_stats::clear() {
+    for (auto& bb: buckets_) {
+        for (auto& b: bb) {
+            b.store(0, std::memory_order_relaxed);
+        }
+    }
+    for (auto& m: max_) {
+        m.store(0, std::memory_order_relaxed);
+    }
+}
+
+handshake_stats::summary handshake_stats::get(phase p) const {
+    std::array<uint64_t, BUCKETS> counts;
+    uint64_t total = 0;
+    for (size_t i = 0; i < BUCKETS; ++i) {
+        counts[i] = buckets_[p][i].load(std::memory_order_relaxed);
+        total += counts[i];
+    }
+    auto at = [&](double q) {
+        auto rank = static_cast<uint64_t>(q * static_cast<double>(total));
+        uint64_t seen = 0;
+        for (size_t i = 0; i < BUCKETS; ++i) {
+            seen += counts[i];
+            if (seen > rank) {
+                return value(i);
+            }
+        }
+        return 0.0;
+    };
+    if (total == 0) {
+        return {0, 0.0, 0.0, 0.0};
+    }
+    return {total, at(0.5), at(0.99), static_cast<double>(max_[p].load(std::memory_order_relaxed))};
+}
+
+const char *handshake_stats::name(phase p) {
+    switch (p) {
+    case local_remote_connect:
+        return "local remote_connect";
+    case local_socks:
+        return "local socks";
+    case local_tunnel:
+        return "local tunnel";
+    case remote_hello:
+        return "remote hello";
+    case remote_resolve:
+        return "remote resolve";
+    case remote_connect:
+        return "remote connect";
+    case remote_reply:
+        return "remote reply";
+    default:
+        return "?";
+    }
+}
+
+size_t handshake_stats::bucket(uint64_t us) {
+    // values below SUB_BUCKETS get one bucket each, above that 8 per power of two
+    if (us < SUB_BUCKETS) {
+        return static_cast<size_t>(us);
+    }
+    size_t octave = 63 - static_cast<size_t>(__builtin_clzll(us));    // >= 3
+    auto sub = static_cast<size_t>(us >> (octave - 3)) & (SUB_BUCKETS - 1);
+    auto index = (octave - 2) * SUB_BUCKETS + sub;
+    return std::min(index, BUCKETS - 1);
+}
+
+double handshake_stats::value(size_t index) {
+    if (index < SUB_BUCKETS) {
+        return static_cast<double>(index);
+    }
+    auto octave = index / SUB_BUCKETS + 2;
+    auto sub = index % SUB_BUCKETS;
+    // middle of the bucket
+    auto low = static_cast<double>((SUB_BUCKETS + sub) << (octave - 3));
+    return low + static_cast<double>(1ull << (octave - 3)) / 2;
+}
+
+}
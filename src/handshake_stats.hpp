@@ -0,0 +1,68 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <chrono>
+
+namespace mole {
+
+// Time spent in each handshake phase, over all sessions of the process. Off by default, then
+// recording costs one relaxed load; benchmarks turn it on to see where connection setup time
+// goes. Durations land in a histogram of 8 buckets per power of two microseconds, so
+// percentiles are exact to about 12%.
+class handshake_stats {
+public:
+    using clock = std::chrono::steady_clock;
+
+    enum phase {
+        local_remote_connect,   // local: tcp connect to the remote
+        local_socks,            // local: SOCKS greeting and command from the client
+        local_tunnel,           // local: hello sent until the remote's reply is in
+        remote_hello,           // remote: accepted until the hello is read and opened
+        remote_resolve,         // remote: DNS of the target
+        remote_connect,         // remote: tcp connect to the target
+        remote_reply,           // remote: reply written
+        PHASES,
+    };
+
+    struct summary {
+        uint64_t count;
+        double p50;     // microseconds
+        double p99;
+        double max;
+    };
+
+    static handshake_stats& self();
+
+    handshake_stats(const handshake_stats&) = delete;
+    handshake_stats(handshake_stats&&) = delete;
+
+    static bool enabled() {
+        return self().enabled_.load(std::memory_order_relaxed);
+    }
+    void enable(bool on) {
+        enabled_.store(on, std::memory_order_relaxed);
+    }
+
+    // records the time since `since` and moves it to now
+    void mark(phase p, clock::time_point& since);
+    void clear();
+    summary get(phase p) const;
+
+    static const char *name(phase p);
+
+private:
+    handshake_stats();
+
+    static constexpr size_t SUB_BUCKETS = 8;
+    static constexpr size_t BUCKETS = 40 * SUB_BUCKETS;
+
+    static size_t bucket(uint64_t us);
+    static double value(size_t index);
+
+    std::atomic<bool> enabled_;
+    std::array<std::array<std::atomic<uint64_t>, BUCKETS>, PHASES> buckets_;
+    std::array<std::atomic<uint64_t>, PHASES> max_;
+};
+
+}
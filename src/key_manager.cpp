@@ -0,0 +1,111 @@
+#include <fstream>
+#include <sstream>
+
+#include "key_manager.hpp"
+
+namespace mole {
+
+key_manager& key_manager::self() {
+    static key_manager km;
+    return km;
+}
+
+void key_manager::init(const std::string& secret, const std::string& hint_secret) {
+    std::lock_guard<std::mutex> lk{mtx_};
+    auto tt = std::make_shared<table>();
+    if (auto old = current()) {
+        tt->users = old->users;
+    }
+    if (!hint_secret.empty()) {
+        tt->hinted = true;
+        tt->hint_key = mole_key::make_hint_key(hint_secret);
+    }
+    if (!secret.empty()) {
+        auto key = std::make_shared<mole_key>(*mole_key::make("", secret));
+        key->hinted = tt->hinted;
+        key->hint_key = tt->hint_key;
+        tt->fallback = std::move(key);
+    }
+    std::atomic_store(&table_, std::shared_ptr<const table>{std::move(tt)});
+}
+
+bool key_manager::load(const std::string& path) {
+    std::lock_guard<std::mutex> lk{mtx_};
+    std::ifstream ifs{path};
+    if (!ifs) {
+        spdlog::error("can NOT open users file {}", path);
+        return false;
+    }
+    auto tt = std::make_shared<table>();
+    if (auto old = current()) {
+        tt->fallback = old->fallback;
+        tt->hinted = old->hinted;
+        tt->hint_key = old->hint_key;
+    }
+    std::string line;
+    size_t lineno = 0;
+    while (std::getline(ifs, line)) {
+        ++lineno;
+        auto p = line.find('#');
+        if (p != std::string::npos) {
+            line.resize(p);
+        }
+        std::istringstream iss{line};
+        std::string user, secret, extra;
+        if (!(iss >> user)) {
+            continue;
+        }
+        if (!(iss >> secret) || (iss >> extra)) {
+            spdlog::error("{}:{}: expected \"user secret\"", path, lineno);
+            return false;
+        }
+        auto key = mole_key::make(user, secret);
+        auto ok = tt->users.emplace(key->id, key).second;
+        if (!ok) {
+            spdlog::error("{}:{}: key id of user {} collides with user {}, change one secret",
+                path, lineno, user, tt->users[key->id]->user);
+            return false;
+        }
+    }
+    path_ = path;
+    spdlog::info("{} users loaded from {}", tt->users.size(), path);
+    std::atomic_store(&table_, std::shared_ptr<const table>{std::move(tt)});
+    return true;
+}
+
+bool key_manager::reload() {
+    std::string path;
+    {
+        std::lock_guard<std::mutex> lk{mtx_};
+        path = path_;
+    }
+    if (path.empty()) {
+        return true;
+    }
+    return load(path);
+}
+
+std::shared_ptr<const mole_key> key_manager::fallback() const {
+    auto tt = current();
+    return tt ? tt->fallback : nullptr;
+}
+
+std::array<std::shared_ptr<const mole_key>, 2> key_manager::candidates(const uint8_t *nonce) const {
+    std::array<std::shared_ptr<const mole_key>, 2> rr;
+    auto tt = current();
+    if (!tt) {
+        return rr;
+    }
+    if (tt->hinted) {
+        auto it = tt->users.find(mole_crypto::hint(nonce, tt->hint_key));
+        if (it != tt->users.end()) {
+            // the hint names the key, a hello is never opened twice
+            rr[0] = it->second;
+            return rr;
+        }
+    }
+    rr[1] = tt->fallback;
+    return rr;
+}
+
+}
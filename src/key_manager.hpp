@@ -0,0 +1,56 @@
+#pragma once
+
+#include <unordered_map>
+
+#include "mole_crypto.hpp"
+#include "utils.hpp"
+
+namespace mole {
+
+// Keys derived once at startup or reload and shared read-only by all sessions. The remote
+// serves many users on one port: each hello names its key through the id hint in the nonce,
+// so the key is found by one lookup. The hint is blinded with a hint key every user shares
+// with the remote, so the same user can not be told apart on the wire. Users need a hint
+// key, without one only the -k key is used. The table is swapped as a whole on reload;
+// sessions that already hold a key keep it until they end.
+class key_manager {
+public:
+    static key_manager& self();
+
+    key_manager(const key_manager&) = delete;
+    key_manager(key_manager&&) = delete;
+
+    // key given by -k, used by the local side, and by the remote for hellos of no user;
+    // hint_secret is the --hint-key of both sides, empty for none
+    void init(const std::string& secret, const std::string& hint_secret);
+
+    // users file, one "user secret" per line, # starts a comment; the table is replaced only
+    // if the whole file is good
+    bool load(const std::string& path);
+    bool reload();
+
+    std::shared_ptr<const mole_key> fallback() const;
+    // the key to open a hello with this nonce: the user named by its hint in [0], or else the
+    // -k key in [1]; at most one is set, a hello is opened once
+    std::array<std::shared_ptr<const mole_key>, 2> candidates(const uint8_t *nonce) const;
+
+private:
+    key_manager() = default;
+
+    struct table {
+        std::shared_ptr<const mole_key> fallback;
+        bool hinted = false;
+        std::array<uint8_t, 32> hint_key{};
+        std::unordered_map<uint32_t, std::shared_ptr<const mole_key>> users;
+    };
+
+    std::shared_ptr<const table> current() const {
+        return std::atomic_load(&table_);
+    }
+
+    std::mutex mtx_;    // serializes writers
+    std::string path_;
+    std::shared_ptr<const table> table_;
+};
+
+}
@@ -3,17 +3,86 @@
 namespace mole {
 
 local_session::local_session(asio::io_context& ctx):
-    local_socket_{ctx}, remote_socket_{ctx},
-    local_buff_{0}, remote_buff_{0}, local_received_{0}, remote_received_{0},
-    crypto_{mole_cfg::self().key()} {
-    local_tx_data_.reserve(BUFF_SIZE);
+    local_socket_{ctx}, remote_socket_{ctx}, direct_resolver_{ctx},
+    remote_reader_{PIPELINE_DEPTH * buffer_pool::BLOCK_SIZE, buffer_pool::BLOCK_SIZE},
+    local_received_{0},
+    local_writing_{false}, remote_writing_{false}, local_paused_{false}, remote_paused_{false},
+    local_eof_{false}, remote_eof_{false}, connecting_{false},
+    format_{frame_format::v1}, frame_size_{BUFF_SIZE},
+    crypto_{key_manager::self().fallback(), mole_crypto::role::local},
+    timeout_{timer_wheel::of(ctx), [this]() {
+        spdlog::debug("timeout");
+        // the handlers cancelled below may hold the last references to the session
+        auto self = shared_from_this();
+        if (connecting_) {
+            // the aborted resolve or connect replies nothing, the session ends once this reply
+            // is written
+            connecting_ = false;
+            std::error_code ec;
+            remote_socket_.close(ec);
+            direct_resolver_.cancel();
+            if (direct_connector_) {
+                direct_connector_->cancel();
+                direct_connector_.reset();
+            }
+            local_reply(0x01); // general SOCKS server failure
+            return;
+        }
+        close();
+    }} {
+}
+
+void local_session::reset() {
+    std::error_code ec;
+    timeout_.cancel();
+    local_socket_.close(ec);
+    remote_socket_.close(ec);
+    direct_resolver_.cancel();
+    if (direct_connector_) {
+        direct_connector_->cancel();
+        direct_connector_.reset();
+    }
+    local_received_ = 0;
+    local_buff_.reset();
+    direct_buff_.reset();
+    remote_reader_.reset();
+    local_queue_.clear();
+    remote_queue_.clear();
+    local_writing_ = false;
+    remote_writing_ = false;
+    local_paused_ = false;
+    remote_paused_ = false;
+    local_eof_ = false;
+    remote_eof_ = false;
+    connecting_ = false;
+    local_tx_data_.clear();
+    target_.clear();
+    format_ = frame_format::v1;
+    frame_size_ = BUFF_SIZE;
+    crypto_.reset();
+}
+
+void local_session::close() {
+    std::error_code ec;
+    local_socket_.close(ec);
+    remote_socket_.close(ec);
+    direct_resolver_.cancel();
+    if (direct_connector_) {
+        direct_connector_->cancel();
+        direct_connector_.reset();
+    }
 }
 
 void local_session::start() {
     spdlog::debug("start");
+    if (handshake_stats::enabled()) {
+        phase_start_ = handshake_stats::clock::now();
+    }
     local_socket_.non_blocking(true);
 
-    remote_connect();
+    // the route is known once the command is in, the remote is connected only for the tunnel
+    expire_after(mole_cfg::self().handshake_timeout());
+    local_receive(3, &local_session::local_hello);
 }
 
 void local_session::local_receive(size_t expected, void (local_session::*handler)()) {
@@ -21,8 +90,11 @@ void local_session::local_receive(size_t expected, void (local_session::*handler
         (this->*handler)();
         return;
     }
-    auto buff = local_buff_.data() + local_received_;
-    auto remain = local_buff_.size() - local_received_;
+    if (!local_buff_) {
+        local_buff_ = buffer_pool::acquire();
+    }
+    auto buff = local_buff_.get() + local_received_;
+    auto remain = BUFF_SIZE - local_received_;
     auto self = shared_from_this();
     asio::async_read(local_socket_, asio::buffer(buff, remain), asio::transfer_at_least(expected - local_received_),
          [this, handler, self](const std::error_code& ec, size_t sz) {
@@ -67,109 +139,243 @@ void local_session::local_command() {
     if (addr_type == 0x01) {
         // ipv4
         uint16_t port = static_cast<uint16_t>(local_buff_[8] << 8u) | local_buff_[9];
-        spdlog::info("target: {}.{}.{}.{}:{}", local_buff_[4], local_buff_[5], local_buff_[6], local_buff_[7], port);
-        target_.assign(local_buff_.data(), local_buff_.data() + local_received_);
-        remote_hello();
+        asio::ip::address_v4 ip{{local_buff_[4], local_buff_[5], local_buff_[6], local_buff_[7]}};
+        auto act = router::self().route(ip);
+        spdlog::info("target: {}:{}, {}", ip.to_string(), port, router::name(act));
+        target_.assign(local_buff_.get(), local_buff_.get() + socks_message_size(local_buff_.get(), local_received_));
+        local_route(act, ip.to_string(), port);
         return;
     } else if (addr_type == 0x03) {
         // domain
         size_t dl = local_buff_[4];
-        if (local_received_ < dl + 6) {
-            local_receive(dl + 6, &local_session::local_command);
+        if (local_received_ < dl + 7) {
+            local_receive(dl + 7, &local_session::local_command);
             return;
         }
         // domain
-        const auto *dm = local_buff_.data() + 5;
-        const auto *pt = local_buff_.data() + 5 + dl;
+        const auto *dm = local_buff_.get() + 5;
+        const auto *pt = local_buff_.get() + 5 + dl;
         uint16_t port = static_cast<uint16_t>(pt[0] << 8u) | pt[1];
         auto domain = std::string{dm, pt};
-        spdlog::info("target: {}:{}", domain, port);
-        target_.assign(local_buff_.data(), local_buff_.data() + local_received_);
-        remote_hello();
+        auto act = router::self().route(domain);
+        spdlog::info("target: {}:{}, {}", domain, port, router::name(act));
+        target_.assign(local_buff_.get(), local_buff_.get() + socks_message_size(local_buff_.get(), local_received_));
+        local_route(act, domain, port);
+    } else if (addr_type == 0x04) {
+        // ipv6
+        if (local_received_ < 22) {
+            local_receive(22, &local_session::local_command);
+            return;
+        }
+        asio::ip::address_v6::bytes_type ip;
+        std::copy(local_buff_.get() + 4, local_buff_.get() + 20, ip.begin());
+        uint16_t port = static_cast<uint16_t>(local_buff_[20] << 8u) | local_buff_[21];
+        auto act = router::self().route(asio::ip::address_v6{ip});
+        spdlog::info("target: [{}]:{}, {}", asio::ip::address_v6{ip}.to_string(), port, router::name(act));
+        target_.assign(local_buff_.get(), local_buff_.get() + socks_message_size(local_buff_.get(), local_received_));
+        local_route(act, asio::ip::address_v6{ip}.to_string(), port);
     } else {
         // do NOT support
-        spdlog::warn("do NOT support IPV6");
+        spdlog::warn("type 0x{:02x} NOT support", addr_type);
         local_reply(0x08); // Address type not supported
     }
 }
 
+void local_session::local_route(router::action act, const std::string& host, uint16_t port) {
+    mark(handshake_stats::local_socks);
+    if (act == router::action::reject) {
+        local_reply(0x02); // Connection not allowed by ruleset
+        return;
+    }
+    if (act == router::action::tunnel) {
+        remote_connect();
+        return;
+    }
+    std::error_code ec;
+    auto ip = asio::ip::make_address(host, ec);
+    if (!ec) {
+        direct_connect({{ip, port}});
+        return;
+    }
+    auto self = shared_from_this();
+    connecting_ = true;
+    direct_resolver_.async_resolve(host, std::to_string(port),
+        [this, self](const std::error_code& ec, const tcp::resolver::results_type& results) {
+        connecting_ = false;
+        if (ec) {
+            spdlog::debug("direct resolve error: {}", ec.message());
+            if (ec != asio::error::operation_aborted) {
+                local_reply(0x04); // Host unreachable
+            }
+            return;
+        }
+        std::vector<tcp::endpoint> endpoints;
+        for (auto& r: results) {
+            endpoints.push_back(r.endpoint());
+        }
+        direct_connect(endpoints);
+    });
+}
+
 void local_session::local_reply(uint8_t reply) {
     local_buff_[1] = reply;
-    asio::async_write(local_socket_, asio::buffer(local_buff_, local_received_), [](const std::error_code&, size_t) {
+    // held until written, the session is reset once released
+    auto self = shared_from_this();
+    asio::async_write(local_socket_, asio::buffer(local_buff_.get(), local_received_), [self](const std::error_code&, size_t) {
         // ignore
     });
 }
 
 void local_session::local_stream() {
+    // idle connections hold no buffer, one is borrowed once the socket turns readable
+    local_buff_.reset();
     auto self = shared_from_this();
-    local_socket_.async_read_some(asio::buffer(local_buff_), [this, self](const std::error_code& ec, std::size_t sz) {
+    local_socket_.async_wait(tcp::socket::wait_read, [this, self](const std::error_code& ec) {
         if (ec) {
-            spdlog::debug("local_stream async_read_some error: {}", ec.message());
+            spdlog::debug("local_stream async_wait error: {}", ec.message());
             return;
         }
-        spdlog::debug("local_socket_ async_read_some: {}", sz);
-        auto pl = sz + mole_crypto::extra_size();
-        local_rx_data_.resize(pl + 2);
-        auto ok = crypto_.encrypt(local_buff_.data(), sz, local_rx_data_.data() + 2);
-        if (!ok) {
-            spdlog::error("encrypt error");
-            return;
-        }
-        local_rx_data_[0] = pl >> 8u;
-        local_rx_data_[1] = pl & 0xffu;
-
-        asio::async_write(remote_socket_, asio::buffer(local_rx_data_), [this, self](const std::error_code& ec, std::size_t) {
-            if (ec) {
-                spdlog::debug("local_stream async_write error: {}", ec.message());
+        touch();
+        // drain what is readable up to the pipeline depth, it all goes out in one write
+        while (remote_queue_.size() < PIPELINE_DEPTH) {
+            auto buff = buffer_pool::acquire(frame_size_ + buffer_pool::HEADROOM);
+            std::error_code rec;
+            // leave room for the header in front, the tag follows the data
+            auto *data = buff.get() + FRAME_HEADER_MAX;
+            auto sz = local_socket_.read_some(asio::buffer(data, frame_size_), rec);
+            if (rec == asio::error::would_block) {
+                break;
+            }
+            if (rec) {
+                spdlog::debug("local_stream read_some error: {}", rec.message());
+                if (rec != asio::error::eof) {
+                    close();
+                    return;
+                }
+                // the rest still goes out, then the EOF is passed on
+                local_eof_ = true;
+                remote_flush();
                 return;
             }
-            local_stream();
-        });
+            spdlog::debug("local_socket_ read_some: {}", sz);
+            auto pl = sz + mole_crypto::extra_size();
+            auto hl = put_frame_header(format_, pl, data);
+            remote_queue_.push_back({std::move(buff), FRAME_HEADER_MAX - hl, pl + hl});
+            if (crypto_pool::self().offload(sz)) {
+                // sealed by a worker, written once it and everything queued before it is done
+                auto& w = remote_queue_.back();
+                w.ready = false;
+                crypto_pool::self().post(remote_socket_.get_executor(),
+                    [this, data, sz, counter = crypto_.next_tx()]() {
+                        return crypto_.seal(counter, data, sz, data);
+                    },
+                    [this, self, &w](bool ok) {
+                        if (!ok) {
+                            spdlog::error("encrypt error");
+                            close();
+                            return;
+                        }
+                        w.ready = true;
+                        remote_flush();
+                    });
+            } else if (!crypto_.encrypt(data, sz, data)) {
+                spdlog::error("encrypt error");
+                close();
+                return;
+            }
+            if (sz < frame_size_) {
+                break;
+            }
+        }
+
+        remote_flush();
+        if (remote_queue_.size() >= PIPELINE_DEPTH) {
+            // resumed by remote_flush
+            local_paused_ = true;
+            return;
+        }
+        local_stream();
     });
 }
 
-
-void local_session::remote_receive(size_t expected, void (local_session::*handler)()) {
-    if (expected <= remote_received_) {
-        (this->*handler)();
+void local_session::local_flush() {
+    if (local_writing_) {
+        return;
+    }
+    // everything ready so far goes out in one gather write
+    auto n = ready_count(local_queue_);
+    if (n == 0) {
+        if (remote_eof_ && local_queue_.empty()) {
+            // everything before the EOF is written, pass it on
+            std::error_code ec;
+            local_socket_.shutdown(tcp::socket::shutdown_send, ec);
+        }
         return;
     }
-    auto buff = remote_buff_.data() + remote_received_;
-    auto remain = remote_buff_.size() - remote_received_;
+    local_writing_ = true;
     auto self = shared_from_this();
-    asio::async_read(remote_socket_, asio::buffer(buff, remain), asio::transfer_at_least(expected - remote_received_),
-         [this, handler, self](const std::error_code& ec, size_t sz) {
-             if (ec) {
-                 spdlog::debug("remote_receive error: {}", ec.message());
-                 return;
-             }
-             remote_received_ += sz;
-             (this->*handler)();
-         }
-    );
+    asio::async_write(local_socket_, gather<PIPELINE_DEPTH>(local_queue_, n), [this, self, n](const std::error_code& ec, std::size_t sz) {
+        if (ec) {
+            spdlog::debug("local_flush async_write error: {}", ec.message());
+            close();
+            return;
+        }
+        spdlog::debug("local_socket_ async_write: {}", sz);
+        local_writing_ = false;
+        remote_reader_.release(local_queue_[n - 1].end);
+        local_queue_.erase(local_queue_.begin(), local_queue_.begin() + n);
+        if (remote_paused_) {
+            remote_paused_ = false;
+            remote_stream();
+        }
+        local_flush();
+    });
 }
 
+
 void local_session::remote_connect() {
     auto self = shared_from_this();
     auto&& ep = mole_cfg::self().remote_endpoint();
+    timeout_.arm(std::chrono::milliseconds(mole_cfg::self().connect_timeout()));
+    connecting_ = true;
     remote_socket_.async_connect(ep, [this, self](const std::error_code& ec) {
+        connecting_ = false;
         if (ec) {
             spdlog::debug("remote_connect error: {}", ec.message());
+            // aborted by close() or by the timeout, which replies itself
+            if (ec == asio::error::connection_refused) {
+                local_reply(0x05); // Connection refused
+            } else if (ec != asio::error::operation_aborted) {
+                local_reply(0x01); // general SOCKS server failure
+            }
             return;
         }
         spdlog::debug("remote connected");
+        mark(handshake_stats::local_remote_connect);
         remote_socket_.non_blocking(true);
+        expire_after(mole_cfg::self().handshake_timeout());
 
-        local_receive(3, &local_session::local_hello);
+        remote_hello();
     });
 }
 
 void local_session::remote_hello() {
     spdlog::debug("remote_hello");
+    // offer the ciphers usable here, the remote answers with its pick in the reply
+    uint8_t ciphers = mole_crypto::available() & mole_cfg::self().ciphers();
+    append_ext(target_, hello_ext::ciphers, &ciphers, 1);
+    auto mf = mole_cfg::self().max_frame();
+    const uint8_t frame_size[4] = {
+        static_cast<uint8_t>(mf >> 24u), static_cast<uint8_t>(mf >> 16u),
+        static_cast<uint8_t>(mf >> 8u), static_cast<uint8_t>(mf),
+    };
+    append_ext(target_, hello_ext::frame_size, frame_size, sizeof(frame_size));
+    append_ext(target_, hello_ext::salt, nullptr, 0);
+
     auto nl = mole_crypto::nonce_size();
     auto pl = target_.size() + mole_crypto::extra_size();
     local_tx_data_.resize(nl + 2 + target_.size() + mole_crypto::extra_size());
-    auto ok = crypto_.encrypt(target_.data(), target_.size(), local_tx_data_.data() + nl + 2);
+    auto ok = crypto_.seal_hello(target_.data(), target_.size(), local_tx_data_.data() + nl + 2);
     if (!ok) {
         spdlog::debug("encrypt failed");
         local_reply(0x01); // general SOCKS server failure
@@ -183,47 +389,297 @@ void local_session::remote_hello() {
     asio::async_write(remote_socket_, asio::buffer(local_tx_data_), [this, self](const std::error_code& ec, std::size_t) {
         if (ec) {
             spdlog::debug("remote_hello error: {}", ec.message());
+            if (ec != asio::error::operation_aborted) {
+                local_reply(0x01); // general SOCKS server failure
+            }
             return;
         }
-
-        spdlog::debug("start stream");
-        remote_received_ = 0;
-        remote_stream();
-
-        local_stream();
+        remote_salt();
     });
 }
 
-void local_session::remote_stream() {
-    if (remote_received_ == 0) {
-        remote_receive(2 + mole_crypto::extra_size(), &local_session::remote_stream);
+void local_session::remote_salt() {
+    // the salt of the remote comes first in the clear, the reply is sealed under it already
+    frame_reader::frame f{};
+    auto r = remote_reader_.next(f);
+    if (r == frame_reader::result::partial) {
+        remote_read(&local_session::remote_salt);
+        return;
+    }
+    if (r != frame_reader::result::frame || f.size != mole_crypto::SALT_SIZE) {
+        spdlog::error("invalid reply");
+        local_reply(0x01); // general SOCKS server failure
         return;
     }
-    size_t pl = static_cast<size_t>(remote_buff_[0] << 8u) | remote_buff_[1];
-    if (remote_received_ < pl + 2) {
-        remote_receive(pl + 2, &local_session::remote_stream);
+    crypto_.salt(f.data);
+    remote_reader_.release(f.end);
+    remote_reply();
+}
+
+void local_session::remote_reply() {
+    // the first frame is the SOCKS reply followed by the cipher picked by the remote
+    frame_reader::frame f{};
+    auto r = remote_reader_.next(f);
+    if (r == frame_reader::result::partial) {
+        remote_read(&local_session::remote_reply);
+        return;
+    }
+    if (r != frame_reader::result::frame || f.size < mole_crypto::extra_size()) {
+        spdlog::error("invalid reply");
+        local_reply(0x01); // general SOCKS server failure
         return;
     }
-    local_tx_data_.resize(pl - mole_crypto::extra_size());
-    auto ok = crypto_.decrypt(remote_buff_.data() + 2, pl, local_tx_data_.data());
+    auto ok = crypto_.decrypt(f.data, f.size, f.data);
     if (!ok) {
         spdlog::error("decrypt error");
+        local_reply(0x01); // general SOCKS server failure
+        return;
+    }
+    auto pl = f.size - mole_crypto::extra_size();
+    auto sl = socks_message_size(f.data, pl);
+    if (sl == 0) {
+        spdlog::error("invalid reply");
+        local_reply(0x01); // general SOCKS server failure
         return;
     }
+    size_t vl = 0;
+    const auto *v = find_ext(f.data + sl, pl - sl, hello_ext::cipher, vl);
+    if (v != nullptr && vl == 1) {
+        auto c = static_cast<mole_crypto::cipher>(v[0]);
+        if (mole_crypto::pick(v[0]) != c || !(mole_crypto::available() & mole_cfg::self().ciphers() & v[0])) {
+            spdlog::error("remote picked cipher 0x{:02x} NOT offered", v[0]);
+            local_reply(0x01); // general SOCKS server failure
+            return;
+        }
+        crypto_.use(c);
+    }
+    v = find_ext(f.data + sl, pl - sl, hello_ext::frame, vl);
+    if (v != nullptr && vl == 4) {
+        auto fs = static_cast<size_t>(v[0]) << 24u | static_cast<size_t>(v[1]) << 16u | static_cast<size_t>(v[2]) << 8u | v[3];
+        if (fs < MIN_FRAME_SIZE || fs > mole_cfg::self().max_frame()) {
+            spdlog::error("remote picked frame size {} NOT offered", fs);
+            local_reply(0x01); // general SOCKS server failure
+            return;
+        }
+        format_ = frame_format::v2;
+        frame_size_ = fs;
+    }
+    mark(handshake_stats::local_tunnel);
+    spdlog::debug("start stream, cipher: {}, frame: {}", mole_crypto::name(crypto_.current()), frame_size_);
+
+    // only the SOCKS reply goes on to the client, it is copied out so the reader can start
+    // over in the agreed framing; end 0 is the start of the reader afterwards
+    local_tx_data_.assign(f.data, f.data + sl);
+    remote_reader_.release(f.end);
+    remote_reader_.configure(PIPELINE_DEPTH * (frame_size_ + buffer_pool::HEADROOM),
+        frame_size_ + buffer_pool::HEADROOM, format_);
+    local_queue_.push_back({local_tx_data_.data(), local_tx_data_.size(), 0});
+    timeout_.cancel();
+    touch();
+    remote_stream();
 
-    remote_received_ -= (pl + 2);
-    if (remote_received_ > 0) {
-        std::memmove(remote_buff_.data(), remote_buff_.data() + pl + 2, remote_received_);
+    local_stream();
+}
+
+void local_session::remote_stream() {
+    // decrypt every complete frame already buffered, in place
+    frame_reader::frame f{};
+    auto r = frame_reader::result::partial;
+    while (local_queue_.size() < PIPELINE_DEPTH && (r = remote_reader_.next(f)) == frame_reader::result::frame) {
+        if (crypto_pool::self().offload(f.size - std::min(f.size, mole_crypto::extra_size()))) {
+            // opened by a worker, written once it and everything queued before it is done
+            local_queue_.push_back({f.data, f.size - mole_crypto::extra_size(), f.end, false});
+            auto& w = local_queue_.back();
+            auto self = shared_from_this();
+            crypto_pool::self().post(local_socket_.get_executor(),
+                [this, f, counter = crypto_.next_rx()]() {
+                    return crypto_.open(counter, f.data, f.size, f.data);
+                },
+                [this, self, &w](bool ok) {
+                    if (!ok) {
+                        spdlog::error("decrypt error");
+                        close();
+                        return;
+                    }
+                    w.ready = true;
+                    local_flush();
+                });
+            continue;
+        }
+        auto ok = crypto_.decrypt(f.data, f.size, f.data);
+        if (!ok) {
+            spdlog::error("decrypt error");
+            close();
+            return;
+        }
+        local_queue_.push_back({f.data, f.size - mole_crypto::extra_size(), f.end});
     }
+    local_flush();
+    if (r == frame_reader::result::invalid) {
+        spdlog::error("invalid frame");
+        close();
+        return;
+    }
+    if (r == frame_reader::result::frame || r == frame_reader::result::blocked || remote_reader_.full()) {
+        // resumed by local_flush
+        remote_paused_ = true;
+        return;
+    }
+
+    if (remote_reader_.empty()) {
+        // nothing buffered, the ring stays in the pool until the next frame shows up
+        remote_reader_.shrink();
+        auto self = shared_from_this();
+        remote_socket_.async_wait(tcp::socket::wait_read, [this, self](const std::error_code& ec) {
+            if (ec) {
+                spdlog::debug("remote_stream async_wait error: {}", ec.message());
+                return;
+            }
+            remote_read(&local_session::remote_stream);
+        });
+        return;
+    }
+    remote_read(&local_session::remote_stream);
+}
 
+void local_session::remote_read(void (local_session::*handler)()) {
     auto self = shared_from_this();
-    asio::async_write(local_socket_, asio::buffer(local_tx_data_), [this, self](const std::error_code& ec, std::size_t sz) {
+    remote_socket_.async_read_some(remote_reader_.prepare(), [this, self, handler](const std::error_code& ec, std::size_t sz) {
         if (ec) {
-            spdlog::debug("remote_stream async_write error: {}", ec.message());
+            spdlog::debug("remote_read error: {}", ec.message());
+            if (handler != &local_session::remote_stream && ec != asio::error::operation_aborted) {
+                // the remote refused the tunnel or dropped it before its reply
+                local_reply(0x01); // general SOCKS server failure
+                return;
+            }
+            if (ec == asio::error::eof) {
+                remote_eof_ = true;
+                local_flush();
+            } else if (ec != asio::error::operation_aborted) {
+                close();
+            }
             return;
         }
-        spdlog::debug("local_socket_ async_write: {}", sz);
-        remote_stream();
+        // every read of the stream pushes the idle timeout back, a bulk download rarely leaves the
+        // ring empty; the reply to the hello is still under the handshake timeout
+        if (handler == &local_session::remote_stream) {
+            touch();
+        }
+        remote_reader_.commit(sz);
+        (this->*handler)();
+    });
+}
+
+void local_session::remote_flush() {
+    if (remote_writing_) {
+        return;
+    }
+    // everything ready so far goes out in one gather write
+    auto n = ready_count(remote_queue_);
+    if (n == 0) {
+        if (local_eof_ && remote_queue_.empty()) {
+            // everything before the EOF is written, pass it on
+            std::error_code ec;
+            remote_socket_.shutdown(tcp::socket::shutdown_send, ec);
+        }
+        return;
+    }
+    remote_writing_ = true;
+    auto self = shared_from_this();
+    asio::async_write(remote_socket_, gather<PIPELINE_DEPTH>(remote_queue_, n), [this, self, n](const std::error_code& ec, std::size_t) {
+        if (ec) {
+            spdlog::debug("remote_flush async_write error: {}", ec.message());
+            close();
+            return;
+        }
+        remote_writing_ = false;
+        remote_queue_.erase(remote_queue_.begin(), remote_queue_.begin() + n);
+        if (local_paused_) {
+            local_paused_ = false;
+            local_stream();
+        }
+        remote_flush();
+    });
+}
+
+void local_session::direct_connect(const std::vector<tcp::endpoint>& endpoints) {
+    auto& cfg = mole_cfg::self();
+    direct_connector_ = std::make_shared<connector>(remote_socket_.get_executor(),
+        std::chrono::milliseconds(cfg.connect_delay()), std::chrono::milliseconds(cfg.connect_timeout()));
+    auto self = shared_from_this();
+    connecting_ = true;
+    direct_connector_->start(endpoints, [this, self](const std::error_code& ec, tcp::socket&& socket) {
+        connecting_ = false;
+        direct_connector_.reset();
+        if (ec) {
+            spdlog::debug("direct connect error: {}", ec.message());
+            if (ec == asio::error::connection_refused) {
+                local_reply(0x05); // Connection refused
+            } else {
+                local_reply(0x01); // general SOCKS server failure
+            }
+            return;
+        }
+        spdlog::debug("direct connected");
+        remote_socket_ = std::move(socket);
+        remote_socket_.non_blocking(true);
+        local_buff_[1] = 0x00; // succeeded
+        asio::async_write(local_socket_, asio::buffer(local_buff_.get(), local_received_),
+            [this, self](const std::error_code& ec, size_t) {
+            if (ec) {
+                spdlog::debug("direct reply error: {}", ec.message());
+                close();
+                return;
+            }
+            timeout_.cancel();
+            touch();
+            direct_stream(local_socket_, remote_socket_, local_buff_, local_eof_);
+            direct_stream(remote_socket_, local_socket_, direct_buff_, remote_eof_);
+        });
+    });
+}
+
+void local_session::direct_stream(tcp::socket& from, tcp::socket& to, buffer_pool::buffer& buff, bool& eof) {
+    // no framing, no crypto, and like the tunnel no buffer while the socket is idle
+    buff.reset();
+    auto self = shared_from_this();
+    from.async_wait(tcp::socket::wait_read, [this, self, &from, &to, &buff, &eof](const std::error_code& ec) {
+        if (ec) {
+            spdlog::debug("direct_stream async_wait error: {}", ec.message());
+            return;
+        }
+        touch();
+        buff = buffer_pool::acquire();
+        std::error_code rec;
+        auto sz = from.read_some(asio::buffer(buff.get(), BUFF_SIZE), rec);
+        if (rec == asio::error::would_block) {
+            direct_stream(from, to, buff, eof);
+            return;
+        }
+        if (rec) {
+            spdlog::debug("direct_stream read_some error: {}", rec.message());
+            buff.reset();
+            if (rec != asio::error::eof) {
+                close();
+                return;
+            }
+            eof = true;
+            std::error_code sec;
+            to.shutdown(tcp::socket::shutdown_send, sec);
+            if (local_eof_ && remote_eof_) {
+                close();
+            }
+            return;
+        }
+        asio::async_write(to, asio::buffer(buff.get(), sz), [this, self, &from, &to, &buff, &eof](
+            const std::error_code& ec, size_t) {
+            if (ec) {
+                spdlog::debug("direct_stream async_write error: {}", ec.message());
+                close();
+                return;
+            }
+            direct_stream(from, to, buff, eof);
+        });
     });
 }
 
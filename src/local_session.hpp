@@ -1,7 +1,17 @@
 #pragma once
 
+#include "buffer_pool.hpp"
+#include "connector.hpp"
+#include "crypto_pool.hpp"
+#include "frame_reader.hpp"
+#include "handshake_stats.hpp"
+#include "key_manager.hpp"
 #include "mole_crypto.hpp"
+#include "proto.hpp"
+#include "router.hpp"
+#include "timer_wheel.hpp"
 #include "utils.hpp"
+#include "write_queue.hpp"
 
 namespace mole {
 
@@ -21,37 +31,101 @@ public:
 
     void start();
 
+    // back to the freshly constructed state, called by session_pool before reuse
+    void reset();
+
 private:
     void local_receive(size_t expected, void (local_session::*handler)());
 
+    // closes both sockets, which ends every pending operation and so the session
+    void close();
+
+    // restarts the timeout with that many seconds, 0 is none
+    void expire_after(size_t seconds) {
+        if (seconds > 0) {
+            timeout_.arm(std::chrono::seconds(seconds));
+        } else {
+            timeout_.cancel();
+        }
+    }
+
+    // the tunnel saw traffic, pushes the idle timeout back
+    void touch() {
+        expire_after(mole_cfg::self().idle_timeout());
+    }
+
+    void mark(handshake_stats::phase p) {
+        if (handshake_stats::enabled()) {
+            handshake_stats::self().mark(p, phase_start_);
+        }
+    }
+
     void local_hello();
     void local_command();
+    // host is a name or an address literal
+    void local_route(router::action act, const std::string& host, uint16_t port);
     void local_reply(uint8_t reply);
     void local_stream();
-
-    void remote_receive(size_t expected, void (local_session::*handler)());
+    void local_flush();
 
     void remote_connect();
     void remote_hello();
+    void remote_salt();
+    void remote_reply();
     void remote_stream();
+    void remote_read(void (local_session::*handler)());
+    void remote_flush();
+
+    void direct_connect(const std::vector<tcp::endpoint>& endpoints);
+    // copies what is readable on from to to as it is, until EOF
+    void direct_stream(tcp::socket& from, tcp::socket& to, buffer_pool::buffer& buff, bool& eof);
 
 private:
     tcp::socket local_socket_;
+    // the remote, or the target itself on a direct route
     tcp::socket remote_socket_;
+    tcp::resolver direct_resolver_;
+    std::shared_ptr<connector> direct_connector_;
 
     static constexpr size_t BUFF_SIZE = 1024 * 32;
+    // chunks a direction may have queued before its reader pauses
+    static constexpr size_t PIPELINE_DEPTH = 4;
 
-    std::array<uint8_t, BUFF_SIZE> local_buff_;
-    std::array<uint8_t, BUFF_SIZE + 128> remote_buff_;
+    // borrowed from buffer_pool only while data is in flight
+    buffer_pool::buffer local_buff_;
+    // direct route: what is read from the target
+    buffer_pool::buffer direct_buff_;
+    frame_reader remote_reader_;
 
     size_t local_received_;
-    size_t remote_received_;
 
-    std::vector<uint8_t> local_rx_data_;
+    // each stream keeps reading while the previous chunks are still being written
+    std::deque<pending_frame> local_queue_;
+    std::deque<pending_write> remote_queue_;
+    bool local_writing_;
+    bool remote_writing_;
+    bool local_paused_;
+    bool remote_paused_;
+    // EOF read on that socket, passed on once the other queue is written
+    bool local_eof_;
+    bool remote_eof_;
+    // the remote or a direct target is being resolved or connected, a timeout then still
+    // answers the client
+    bool connecting_;
+
     std::vector<uint8_t> local_tx_data_;
     std::vector<uint8_t> target_;
 
+    // framing of the data frames, settled by the hello reply
+    frame_format format_;
+    size_t frame_size_;
+
     mole_crypto crypto_;
+
+    handshake_stats::clock::time_point phase_start_;
+
+    // handshake, then idle timeout, on the wheel of the session's context
+    timer_wheel::entry timeout_;
 };
 
 }
@@ -1,5 +1,12 @@
+#include <charconv>
+
+#include "crypto_pool.hpp"
+#include "domain_cache.hpp"
+#include "dns_resolver.hpp"
+#include "key_manager.hpp"
 #include "local_session.hpp"
 #include "remote_session.hpp"
+#include "router.hpp"
 #include "tcp_srv.hpp"
 #include "utils.hpp"
 
@@ -8,6 +15,7 @@
 constexpr const char* name = "mole";
 
 asio::ip::tcp::endpoint parse_remote(const std::string& remote);
+std::vector<asio::ip::udp::endpoint> parse_nameservers(const std::string& list);
 
 int main(int argc, char** argv) {
     cxxopts::Options options(name, "a simple proxy");
@@ -15,9 +23,53 @@ int main(int argc, char** argv) {
     options.add_options()("help", "show help");
     options.add_options()("d,dev", "dev mode");
     options.add_options()("m,mode", "mode", cxxopts::value<std::string>(), "local/remote");
-    options.add_options()("r,remote", "remote address", cxxopts::value<std::string>(), "remote");
+    options.add_options()("r,remote", "remote address, ip:port or [ipv6]:port", cxxopts::value<std::string>(), "remote");
     options.add_options()("k,key", "key for crypto", cxxopts::value<std::string>(), "key");
+    options.add_options()("hint-key", "secret shared by every user of a remote, hides which user a connection "
+        "belongs to while the remote still finds the key at once", cxxopts::value<std::string>(), "secret");
+    options.add_options()("u,users", "remote: file of \"user key\" lines, reloaded on SIGHUP, needs --hint-key",
+        cxxopts::value<std::string>(), "file");
+    options.add_options()("rules", "local: file of \"kind value action\" lines routing targets direct, through the "
+        "tunnel or nowhere", cxxopts::value<std::string>(), "file");
     options.add_options()("p,port", "listen port", cxxopts::value<uint16_t>()->default_value("20903"), "port");
+    options.add_options()("t,threads", "connection threads", cxxopts::value<size_t>()->default_value("1"), "threads");
+    options.add_options()("pin", "pin connection threads to cpus");
+    options.add_options()("reuse-port", "one SO_REUSEPORT listener per connection thread");
+    options.add_options()("cipher", "cipher for data frames", cxxopts::value<std::string>()->default_value("auto"),
+        "auto/chacha20/aes256gcm");
+    options.add_options()("max-frame", "max bytes per tunnel frame, 1024 to 1048576",
+        cxxopts::value<size_t>()->default_value("32768"), "bytes");
+    options.add_options()("crypto-threads", "worker threads for encrypting large frames",
+        cxxopts::value<size_t>()->default_value("0"), "threads");
+    options.add_options()("connect-delay", "remote: ms between connect attempts to the addresses of a target",
+        cxxopts::value<size_t>()->default_value("250"), "ms");
+    options.add_options()("connect-timeout", "ms before one connect attempt gives up",
+        cxxopts::value<size_t>()->default_value("10000"), "ms");
+    options.add_options()("handshake-timeout", "seconds a connection may take to set up its tunnel, 0 for none",
+        cxxopts::value<size_t>()->default_value("10"), "seconds");
+    options.add_options()("idle-timeout", "seconds a tunnel may stay without traffic, 0 for none",
+        cxxopts::value<size_t>()->default_value("300"), "seconds");
+    options.add_options()("dns-ttl", "remote: seconds a name resolved by getaddrinfo, an address literal or "
+        "localhost is cached; names resolved with --dns keep the TTL of their records, see --dns-min-ttl",
+        cxxopts::value<size_t>()->default_value("60"), "seconds");
+    options.add_options()("dns-negative-ttl", "remote: seconds a name that does not resolve is cached",
+        cxxopts::value<size_t>()->default_value("5"), "seconds");
+    options.add_options()("dns-min-ttl", "remote: seconds a name resolved with --dns is cached at least",
+        cxxopts::value<size_t>()->default_value("5"), "seconds");
+    options.add_options()("dns-max-ttl", "remote: seconds a name resolved with --dns is cached at most",
+        cxxopts::value<size_t>()->default_value("3600"), "seconds");
+    options.add_options()("dns-stale", "remote: seconds an expired name is still used while it is resolved again, 0 for none",
+        cxxopts::value<size_t>()->default_value("30"), "seconds");
+    options.add_options()("dns-cache-size", "remote: names kept in the dns cache at most",
+        cxxopts::value<size_t>()->default_value("65536"), "n");
+    options.add_options()("dns-cache-file", "remote: load the dns cache from this file at start, save it on exit",
+        cxxopts::value<std::string>(), "file");
+    options.add_options()("dns", "remote: resolve through these nameservers instead of getaddrinfo, "
+        "ip[:port],[ipv6]:port,... or auto for those of /etc/resolv.conf", cxxopts::value<std::string>(), "servers");
+    options.add_options()("dns-timeout", "remote: ms to wait for a nameserver",
+        cxxopts::value<size_t>()->default_value("1000"), "ms");
+    options.add_options()("dns-attempts", "remote: rounds over the nameservers before a name fails",
+        cxxopts::value<size_t>()->default_value("2"), "n");
     auto args = options.parse(argc, argv);
 
     if (args.count("help") > 0) {
@@ -37,34 +89,141 @@ int main(int argc, char** argv) {
     auto& cfg = mole::mole_cfg::self();
     cfg.dev(args.count("dev") > 0);
     cfg.port(args["port"].as<uint16_t>());
+    cfg.threads(args["threads"].as<size_t>());
+    cfg.pin(args.count("pin") > 0);
+    cfg.reuse_port(args.count("reuse-port") > 0);
+    auto cipher = args["cipher"].as<std::string>();
+    if (cipher == "chacha20") {
+        cfg.ciphers(static_cast<uint8_t>(mole::mole_crypto::cipher::chacha20_poly1305));
+    } else if (cipher == "aes256gcm") {
+        cfg.ciphers(static_cast<uint8_t>(mole::mole_crypto::cipher::aes256_gcm));
+    } else if (cipher != "auto") {
+        std::cerr << "ERROR: unknown cipher " << cipher << std::endl;
+        return 0;
+    }
+    cfg.max_frame(std::min(std::max(args["max-frame"].as<size_t>(), mole::MIN_FRAME_SIZE), mole::MAX_FRAME_SIZE));
+    cfg.crypto_threads(args["crypto-threads"].as<size_t>());
+    cfg.connect_delay(args["connect-delay"].as<size_t>());
+    cfg.connect_timeout(std::max<size_t>(args["connect-timeout"].as<size_t>(), 1));
+    cfg.handshake_timeout(args["handshake-timeout"].as<size_t>());
+    cfg.idle_timeout(args["idle-timeout"].as<size_t>());
+    cfg.dns_ttl(args["dns-ttl"].as<size_t>());
+    cfg.dns_negative_ttl(args["dns-negative-ttl"].as<size_t>());
+    cfg.dns_min_ttl(args["dns-min-ttl"].as<size_t>());
+    cfg.dns_max_ttl(std::max(args["dns-max-ttl"].as<size_t>(), cfg.dns_min_ttl()));
+    cfg.dns_stale(args["dns-stale"].as<size_t>());
+    cfg.dns_cache_size(args["dns-cache-size"].as<size_t>());
+    if (args.count("dns-cache-file") > 0) {
+        cfg.dns_cache_file(args["dns-cache-file"].as<std::string>());
+    }
+    cfg.dns_timeout(std::max<size_t>(args["dns-timeout"].as<size_t>(), 1));
+    cfg.dns_attempts(args["dns-attempts"].as<size_t>());
+    if (args.count("dns") > 0) {
+        auto dns = args["dns"].as<std::string>();
+        auto ns = dns == "auto" ? mole::dns_resolver::system_nameservers() : parse_nameservers(dns);
+        if (ns.empty()) {
+            std::cerr << "ERROR: no nameserver in " << dns << std::endl;
+            return 0;
+        }
+        cfg.nameservers(ns);
+    }
     if (args.count("key") > 0) {
         cfg.key(args["key"].as<std::string>());
     }
+    if (args.count("users") > 0) {
+        cfg.users(args["users"].as<std::string>());
+    }
+    if (args.count("hint-key") > 0) {
+        cfg.hint_key(args["hint-key"].as<std::string>());
+    }
+    if (args.count("rules") > 0) {
+        cfg.rules(args["rules"].as<std::string>());
+    }
     if (args.count("remote") > 0) {
         auto ep = parse_remote(args["remote"].as<std::string>());
         cfg.remote_endpoint(ep);
     }
 
-    if (cfg.key().empty()) {
+    if (cfg.key().empty() && (mode == "local" || cfg.users().empty())) {
         std::cerr << "ERROR: key is required!"<< std::endl;
         return 0;
     }
+    if (mode == "remote" && !cfg.users().empty() && cfg.hint_key().empty()) {
+        std::cerr << "ERROR: hint-key is required with users!"<< std::endl;
+        return 0;
+    }
     if (mode == "local" && cfg.remote_endpoint().address().is_unspecified()) {
         std::cerr << "ERROR: remote is required!"<< std::endl;
         return 0;
     }
 
     mole::logging_init(name, cfg.dev());
+    if (!mole::mole_crypto::init()) {
+        spdlog::error("crypto init failed");
+        return 1;
+    }
     spdlog::info("start {}, mode: {}, dev={}", name, mode, cfg.dev());
+    mole::crypto_pool::self().start(cfg.crypto_threads());
+    auto& km = mole::key_manager::self();
+    km.init(cfg.key(), cfg.hint_key());
+    if (mode == "remote" && !cfg.users().empty() && !km.load(cfg.users())) {
+        return 1;
+    }
+    if (mode == "local" && !cfg.rules().empty() && !mole::router::self().load(cfg.rules())) {
+        return 1;
+    }
+    if (!(mole::mole_crypto::available() & static_cast<uint8_t>(mole::mole_crypto::cipher::aes256_gcm))) {
+        spdlog::info("aes-256-gcm not available on this cpu, using chacha20-poly1305");
+    }
 
     if (mode == "local") {
         auto&& ep = cfg.remote_endpoint();
         spdlog::info("remote: {}:{}", ep.address().to_string(), ep.port());
-        auto srv = mole::tcp_srv<mole::local_session>(cfg.port());
+        auto srv = mole::tcp_srv<mole::local_session>(cfg.port(), cfg.threads(), cfg.pin(), cfg.reuse_port());
         srv.run();
+        // queued crypto jobs hold sessions, they must be done before the contexts go
+        mole::crypto_pool::self().stop();
     } else {
-        auto srv = mole::tcp_srv<mole::remote_session>(cfg.port());
+        for (auto& ns: cfg.nameservers()) {
+            spdlog::info("nameserver: {}:{}", ns.address().to_string(), ns.port());
+        }
+        auto& dc = mole::domain_cache::self();
+        if (!cfg.dns_cache_file().empty()) {
+            dc.load(cfg.dns_cache_file());
+        }
+        auto srv = mole::tcp_srv<mole::remote_session>(cfg.port(), cfg.threads(), cfg.pin(), cfg.reuse_port());
+
+        // SIGHUP reloads the users file, on its own thread so no connection thread waits for it;
+        // SIGINT and SIGTERM stop the server so the dns cache gets saved
+        asio::io_context sig_ctx{1};
+        asio::signal_set sigs{sig_ctx, SIGHUP, SIGINT, SIGTERM};
+        std::function<void(const std::error_code&, int)> on_signal = [&](const std::error_code& ec, int sig) {
+            if (ec) {
+                return;
+            }
+            if (sig != SIGHUP) {
+                spdlog::info("signal {}, stop", sig);
+                srv.stop();
+                return;
+            }
+            spdlog::info("SIGHUP, reload users");
+            km.reload();
+            sigs.async_wait(on_signal);
+        };
+        sigs.async_wait(on_signal);
+        std::thread sig_thread{[&sig_ctx]() {
+            sig_ctx.run();
+        }};
+
         srv.run();
+        sig_ctx.stop();
+        sig_thread.join();
+        mole::crypto_pool::self().stop();
+        auto u = dc.stats();
+        spdlog::info("dns cache: {} names, {} KB, {} evicted", u.entries, u.bytes / 1024, u.evicted);
+        if (!cfg.dns_cache_file().empty()) {
+            dc.save(cfg.dns_cache_file());
+        }
     }
 
     return 0;
@@ -72,11 +231,47 @@ int main(int argc, char** argv) {
 
 
 asio::ip::tcp::endpoint parse_remote(const std::string& remote) {
-    auto ss = mole::split(remote, ':');
-    if (ss.size() != 2) {
+    // ip:port, or [ip]:port for IPv6
+    auto colon = remote.rfind(':');
+    if (colon == std::string::npos || colon + 1 == remote.size()) {
+        return {};
+    }
+    auto host = remote.substr(0, colon);
+    if (host.size() > 2 && host.front() == '[' && host.back() == ']') {
+        host = host.substr(1, host.size() - 2);
+    } else if (host.find(':') != std::string::npos) {
+        return {};
+    }
+    std::error_code ec;
+    auto ip = asio::ip::make_address(host, ec);
+    if (ec) {
         return {};
     }
-    auto ip = asio::ip::make_address(ss[0]);
-    auto port = static_cast<uint16_t>(std::stoul(ss[1]));
-    return {ip, port};
-}
\ No newline at end of file
+    // 1 to 65535, nothing else after it
+    uint32_t port = 0;
+    const auto *end = remote.data() + remote.size();
+    auto [p, pec] = std::from_chars(remote.data() + colon + 1, end, port);
+    if (pec != std::errc{} || p != end || port == 0 || port > UINT16_MAX) {
+        return {};
+    }
+    return {ip, static_cast<uint16_t>(port)};
+}
+
+std::vector<asio::ip::udp::endpoint> parse_nameservers(const std::string& list) {
+    // the same forms as the remote, the port may be left out
+    std::vector<asio::ip::udp::endpoint> rr;
+    for (auto& s: mole::split(list, ',')) {
+        std::error_code ec;
+        auto ip = asio::ip::make_address(s, ec);
+        if (!ec) {
+            rr.emplace_back(ip, 53);
+            continue;
+        }
+        auto ep = parse_remote(s);
+        if (ep.address().is_unspecified()) {
+            return {};
+        }
+        rr.emplace_back(ep.address(), ep.port());
+    }
+    return rr;
+}
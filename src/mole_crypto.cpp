@@ -5,30 +5,206 @@
 
 namespace mole {
 
-mole_crypto::mole_crypto(const std::string& key):key_{make_key(key)} {
-    nonce_.resize(nonce_size());
-    randombytes_buf(nonce_.data(), nonce_.size());
+static_assert(sizeof(crypto_aead_aes256gcm_state) <= 512, "aes state does not fit");
+static_assert(crypto_aead_xchacha20poly1305_ietf_NPUBBYTES == 24, "unexpected nonce size");
+
+std::shared_ptr<const mole_key> mole_key::make(const std::string& user, const std::string& secret) {
+    auto key = std::make_shared<mole_key>();
+    key->user = user;
+    auto kk = mole_crypto::make_key(secret);
+    std::memcpy(key->data.data(), kk.data(), key->data.size());
+    // id = BLAKE2b keyed with the key over a fixed label, reveals nothing about the key
+    const char label[] = "mole key id";
+    uint8_t hh[crypto_generichash_BYTES_MIN];
+    crypto_generichash(hh, sizeof(hh), reinterpret_cast<const uint8_t*>(label), sizeof(label) - 1,
+        key->data.data(), key->data.size());
+    key->id = static_cast<uint32_t>(hh[0]) | static_cast<uint32_t>(hh[1]) << 8u |
+        static_cast<uint32_t>(hh[2]) << 16u | static_cast<uint32_t>(hh[3]) << 24u;
+    return key;
+}
+
+std::array<uint8_t, 32> mole_key::make_hint_key(const std::string& secret) {
+    auto kk = mole_crypto::make_key(secret);
+    const char label[] = "mole key hint";
+    std::array<uint8_t, 32> hk{};
+    crypto_generichash(hk.data(), hk.size(), reinterpret_cast<const uint8_t*>(label), sizeof(label) - 1,
+        kk.data(), kk.size());
+    return hk;
+}
+
+namespace {
+
+// PRF of the random part of the nonce, what the key id in its last 4 bytes is masked with
+uint32_t hint_mask(const uint8_t *nonce, size_t size, const std::array<uint8_t, 32>& hint_key) {
+    uint8_t hh[crypto_generichash_BYTES_MIN];
+    crypto_generichash(hh, sizeof(hh), nonce, size - 4, hint_key.data(), hint_key.size());
+    return static_cast<uint32_t>(hh[0]) | static_cast<uint32_t>(hh[1]) << 8u |
+        static_cast<uint32_t>(hh[2]) << 16u | static_cast<uint32_t>(hh[3]) << 24u;
+}
+
+}
+
+mole_crypto::mole_crypto(std::shared_ptr<const mole_key> key, role r):
+    key_{std::move(key)}, nonce_{}, salt_{}, salted_{false}, subkey_{}, aes_state_{}, role_{r},
+    cipher_{cipher::chacha20_poly1305}, tx_counter_{0}, rx_counter_{0} {
+    reset();
 }
 
-bool mole_crypto::encrypt(const uint8_t *data, std::size_t len, uint8_t *out) {
+void mole_crypto::reset() {
+    tx_counter_ = 0;
+    rx_counter_ = 0;
+    cipher_ = cipher::chacha20_poly1305;
+    salted_ = false;
+    if (role_ == role::local) {
+        randombytes_buf(nonce_.data(), nonce_.size());
+        if (key_->hinted) {
+            // the last 4 bytes carry the key id masked with a PRF of the other 20 under the hint
+            // key, only who holds it can tell which key a hello names, see hint()
+            auto id = key_->id ^ hint_mask(nonce_.data(), nonce_.size(), key_->hint_key);
+            for (size_t i = 0; i < 4; ++i) {
+                nonce_[NONCE_SIZE - 4 + i] = static_cast<uint8_t>(id >> (8 * i));
+            }
+        }
+        derive(cipher_);
+    } else {
+        key_.reset();
+    }
+}
+
+bool mole_crypto::seal_hello(const uint8_t *data, std::size_t len, uint8_t *out) const {
     auto ok = crypto_aead_xchacha20poly1305_ietf_encrypt(
-        out, nullptr, data, len, nullptr, 0, nullptr, nonce_.data(), key_.data());
+        out, nullptr, data, len, nullptr, 0, nullptr, nonce_.data(), key_->data.data());
     return ok == 0;
 }
 
-bool mole_crypto::decrypt(const uint8_t *data, std::size_t len, uint8_t *out) {
+bool mole_crypto::open_hello(const uint8_t *data, std::size_t len, uint8_t *out) const {
     auto ok = crypto_aead_xchacha20poly1305_ietf_decrypt(
-        out, nullptr, nullptr, data, len, nullptr, 0, nonce_.data(), key_.data());
+        out, nullptr, nullptr, data, len, nullptr, 0, nonce_.data(), key_->data.data());
+    return ok == 0;
+}
+
+bool mole_crypto::seal(uint64_t counter, const uint8_t *data, std::size_t len, uint8_t *out) const {
+    uint8_t nn[FRAME_NONCE_SIZE];
+    frame_nonce(role_ == role::local ? 0 : 1, counter, nn);
+    int ok;
+    if (cipher_ == cipher::aes256_gcm) {
+        auto *st = reinterpret_cast<const crypto_aead_aes256gcm_state*>(aes_state_.data());
+        ok = crypto_aead_aes256gcm_encrypt_afternm(out, nullptr, data, len, nullptr, 0, nullptr, nn, st);
+    } else {
+        ok = crypto_aead_chacha20poly1305_ietf_encrypt(
+            out, nullptr, data, len, nullptr, 0, nullptr, nn, subkey_.data());
+    }
     return ok == 0;
 }
 
+bool mole_crypto::open(uint64_t counter, const uint8_t *data, std::size_t len, uint8_t *out) const {
+    uint8_t nn[FRAME_NONCE_SIZE];
+    frame_nonce(role_ == role::local ? 1 : 0, counter, nn);
+    int ok;
+    if (cipher_ == cipher::aes256_gcm) {
+        auto *st = reinterpret_cast<const crypto_aead_aes256gcm_state*>(aes_state_.data());
+        ok = crypto_aead_aes256gcm_decrypt_afternm(out, nullptr, nullptr, data, len, nullptr, 0, nn, st);
+    } else {
+        ok = crypto_aead_chacha20poly1305_ietf_decrypt(
+            out, nullptr, nullptr, data, len, nullptr, 0, nn, subkey_.data());
+    }
+    return ok == 0;
+}
+
+void mole_crypto::use(cipher c) {
+    if (c == cipher_) {
+        return;
+    }
+    cipher_ = c;
+    derive(c);
+}
+
+void mole_crypto::salt(const uint8_t *dd) {
+    std::memcpy(salt_.data(), dd, salt_.size());
+    salted_ = true;
+    derive(cipher_);
+}
+
+void mole_crypto::random_salt(uint8_t *dd) {
+    randombytes_buf(dd, SALT_SIZE);
+}
+
 
 void mole_crypto::nonce_copy_to(uint8_t *dd) const {
     std::memcpy(dd, nonce_.data(), nonce_.size());
 }
 
 void mole_crypto::nonce(const uint8_t *dd) {
-    nonce_.assign(dd, dd + nonce_size());
+    std::memcpy(nonce_.data(), dd, nonce_.size());
+    derive(cipher_);
+}
+
+void mole_crypto::derive(cipher c) {
+    // subkey = BLAKE2b keyed with the long-term key over the session nonce and the salt of the
+    // reply once there is one, other ciphers than ChaCha20 get the cipher id appended so no key
+    // is shared between them
+    uint8_t in[NONCE_SIZE + SALT_SIZE + 1];
+    std::memcpy(in, nonce_.data(), nonce_.size());
+    size_t il = nonce_.size();
+    if (salted_) {
+        std::memcpy(in + il, salt_.data(), salt_.size());
+        il += salt_.size();
+    }
+    if (c != cipher::chacha20_poly1305) {
+        in[il++] = static_cast<uint8_t>(c);
+    }
+    crypto_generichash(subkey_.data(), subkey_.size(), in, il, key_->data.data(), key_->data.size());
+    if (c == cipher::aes256_gcm) {
+        auto *st = reinterpret_cast<crypto_aead_aes256gcm_state*>(aes_state_.data());
+        crypto_aead_aes256gcm_beforenm(st, subkey_.data());
+    }
+}
+
+void mole_crypto::frame_nonce(uint32_t direction, uint64_t counter, uint8_t *out) const {
+    for (size_t i = 0; i < 4; ++i) {
+        out[i] = static_cast<uint8_t>(direction >> (8 * i));
+    }
+    for (size_t i = 0; i < 8; ++i) {
+        out[4 + i] = static_cast<uint8_t>(counter >> (8 * i));
+    }
+}
+
+bool mole_crypto::init() {
+    // also selects the fastest implementations for this cpu
+    return sodium_init() >= 0;
+}
+
+uint8_t mole_crypto::available() {
+    auto mask = static_cast<uint8_t>(cipher::chacha20_poly1305);
+    if (crypto_aead_aes256gcm_is_available()) {
+        // needs AES-NI and PCLMUL
+        mask |= static_cast<uint8_t>(cipher::aes256_gcm);
+    }
+    return mask;
+}
+
+mole_crypto::cipher mole_crypto::pick(uint8_t mask) {
+    if (mask & static_cast<uint8_t>(cipher::aes256_gcm)) {
+        return cipher::aes256_gcm;
+    }
+    return cipher::chacha20_poly1305;
+}
+
+const char *mole_crypto::name(cipher c) {
+    switch (c) {
+    case cipher::aes256_gcm:
+        return "aes-256-gcm";
+    default:
+        return "chacha20-poly1305";
+    }
+}
+
+uint32_t mole_crypto::hint(const uint8_t *nonce, const std::array<uint8_t, 32>& hint_key) {
+    uint32_t id = 0;
+    for (size_t i = 0; i < 4; ++i) {
+        id |= static_cast<uint32_t>(nonce[NONCE_SIZE - 4 + i]) << (8 * i);
+    }
+    return id ^ hint_mask(nonce, NONCE_SIZE, hint_key);
 }
 
 size_t mole_crypto::nonce_size() {
@@ -36,7 +212,7 @@ size_t mole_crypto::nonce_size() {
 }
 
 size_t mole_crypto::extra_size() {
-    return crypto_aead_xchacha20poly1305_ietf_abytes();
+    return crypto_aead_chacha20poly1305_ietf_abytes();
 }
 
 std::vector<uint8_t> mole_crypto::make_key(const std::string &key) {
@@ -1,32 +1,137 @@
 #pragma once
 
+#include <array>
+#include <memory>
 #include <string>
 #include <vector>
 
 namespace mole {
 
+// Long-term key, derived once from its secret and shared read-only by all sessions using it.
+struct mole_key {
+    std::string user;
+    std::array<uint8_t, 32> data;
+    // carried in the hello nonce so the remote finds the key without trial decryption
+    uint32_t id;
+    // local side: the hint key of the remote, which blinds id in the nonce; no hint without it
+    bool hinted = false;
+    std::array<uint8_t, 32> hint_key{};
+
+    static std::shared_ptr<const mole_key> make(const std::string& user, const std::string& secret);
+    static std::array<uint8_t, 32> make_hint_key(const std::string& secret);
+};
+
+// A session starts with a random nonce sent in the clear by the local side. The hello frame
+// carrying it is sealed with XChaCha20-Poly1305 under the long-term key. Both ends then derive
+// a per-session subkey from that nonce, and every following frame uses an IETF AEAD under the
+// subkey with a 96-bit nonce of direction and frame counter, so no nonce repeats.
+// A replayed hello would give the same subkey, so the remote answers with a random salt in the
+// clear and its reply and every frame after it use a subkey over nonce and salt; nothing of a
+// replayed session is ever sealed under the keys of another one.
+// The data cipher starts as ChaCha20-Poly1305 and may be switched to AES-256-GCM once both
+// ends have agreed on it in the hello.
 class mole_crypto {
 public:
-    explicit mole_crypto(const std::string& key);
+    enum class role {
+        local,
+        remote,
+    };
+
+    // bit values, also used on the wire
+    enum class cipher: uint8_t {
+        chacha20_poly1305 = 0x01,
+        aes256_gcm = 0x02,
+    };
+
+    static constexpr size_t SALT_SIZE = 16;
+
+    // the remote side gets its key from the hello, see key()
+    mole_crypto(std::shared_ptr<const mole_key> key, role r);
     ~mole_crypto() = default;
 
     mole_crypto(const mole_crypto&) = default;
     mole_crypto(mole_crypto&&) = default;
 
 public:
-    bool encrypt(const uint8_t *data, std::size_t len, uint8_t *out);
-    bool decrypt(const uint8_t *data, std::size_t len, uint8_t *out);
+    // fresh session: the local side draws a new nonce, counters start over
+    void reset();
+
+    const std::shared_ptr<const mole_key>& key() const {
+        return key_;
+    }
+    // set before nonce()
+    void key(std::shared_ptr<const mole_key> k) {
+        key_ = std::move(k);
+    }
+
+    bool seal_hello(const uint8_t *data, std::size_t len, uint8_t *out) const;
+    bool open_hello(const uint8_t *data, std::size_t len, uint8_t *out) const;
+
+    // data frames, in and out may be the same buffer
+    bool encrypt(const uint8_t *data, std::size_t len, uint8_t *out) {
+        return seal(next_tx(), data, len, out);
+    }
+    bool decrypt(const uint8_t *data, std::size_t len, uint8_t *out) {
+        return open(next_rx(), data, len, out);
+    }
+
+    // for frames handled off the session thread: counters are taken in frame order on the
+    // session thread, seal/open may then run on any thread
+    uint64_t next_tx() {
+        return tx_counter_++;
+    }
+    uint64_t next_rx() {
+        return rx_counter_++;
+    }
+    bool seal(uint64_t counter, const uint8_t *data, std::size_t len, uint8_t *out) const;
+    bool open(uint64_t counter, const uint8_t *data, std::size_t len, uint8_t *out) const;
+
+    // switch the data frames to another cipher, counters carry on
+    void use(cipher c);
+    // mix the salt sent by the remote into the subkey, counters carry on
+    void salt(const uint8_t *dd);
+    // remote: a fresh salt for a session
+    static void random_salt(uint8_t *dd);
+    cipher current() const {
+        return cipher_;
+    }
 
     void nonce_copy_to(uint8_t *dd) const;
+    // the remote side adopts the nonce received in the hello
     void nonce(const uint8_t *dd);
 
+    static bool init();
+    // bitmask of the ciphers this machine can run
+    static uint8_t available();
+    // the fastest cipher in mask, ChaCha20-Poly1305 if none
+    static cipher pick(uint8_t mask);
+    static const char *name(cipher c);
+    // key id hint of a received hello nonce, unblinded with the hint key of the remote
+    static uint32_t hint(const uint8_t *nonce, const std::array<uint8_t, 32>& hint_key);
     static size_t nonce_size();
     static size_t extra_size();
     static std::vector<uint8_t> make_key(const std::string& key);
 
 private:
-    const std::vector<uint8_t> key_;
-    std::vector<uint8_t> nonce_;
+    void derive(cipher c);
+    void frame_nonce(uint32_t direction, uint64_t counter, uint8_t *out) const;
+
+private:
+    static constexpr size_t KEY_SIZE = 32;
+    static constexpr size_t NONCE_SIZE = 24;
+    static constexpr size_t FRAME_NONCE_SIZE = 12;
+
+    std::shared_ptr<const mole_key> key_;
+    std::array<uint8_t, NONCE_SIZE> nonce_;
+    std::array<uint8_t, SALT_SIZE> salt_;
+    bool salted_;
+    std::array<uint8_t, KEY_SIZE> subkey_;
+    // expanded AES key, crypto_aead_aes256gcm_state
+    alignas(16) std::array<uint8_t, 512> aes_state_;
+    role role_;
+    cipher cipher_;
+    uint64_t tx_counter_;
+    uint64_t rx_counter_;
 };
 
 }
@@ -0,0 +1,71 @@
+#include <cstring>
+
+#include "proto.hpp"
+
+namespace mole {
+
+size_t socks_message_size(const uint8_t *data, size_t len) {
+    if (len < 5) {
+        return 0;
+    }
+    size_t sz = 0;
+    switch (data[3]) {
+    case 0x01:
+        sz = 4 + 4 + 2;
+        break;
+    case 0x03:
+        sz = 4 + 1 + data[4] + 2;
+        break;
+    case 0x04:
+        sz = 4 + 16 + 2;
+        break;
+    default:
+        return 0;
+    }
+    return sz <= len ? sz : 0;
+}
+
+size_t put_frame_header(frame_format fmt, size_t len, uint8_t *end) {
+    if (fmt == frame_format::v1) {
+        end[-2] = static_cast<uint8_t>(len >> 8u);
+        end[-1] = static_cast<uint8_t>(len & 0xffu);
+        return 2;
+    }
+    uint8_t tmp[FRAME_HEADER_MAX];
+    size_t n = 0;
+    do {
+        tmp[n] = static_cast<uint8_t>(len & 0x7fu);
+        len >>= 7u;
+        if (len != 0) {
+            tmp[n] |= 0x80u;
+        }
+        ++n;
+    } while (len != 0 && n < FRAME_HEADER_MAX);
+    std::memcpy(end - n, tmp, n);
+    return n;
+}
+
+void append_ext(std::vector<uint8_t>& out, hello_ext type, const uint8_t *value, size_t len) {
+    out.push_back(static_cast<uint8_t>(type));
+    out.push_back(static_cast<uint8_t>(len));
+    out.insert(out.end(), value, value + len);
+}
+
+const uint8_t *find_ext(const uint8_t *data, size_t len, hello_ext type, size_t& value_len) {
+    size_t i = 0;
+    while (i + 2 <= len) {
+        auto t = data[i];
+        size_t l = data[i + 1];
+        if (i + 2 + l > len) {
+            break;
+        }
+        if (t == static_cast<uint8_t>(type)) {
+            value_len = l;
+            return data + i + 2;
+        }
+        i += 2 + l;
+    }
+    return nullptr;
+}
+
+}
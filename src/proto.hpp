@@ -0,0 +1,45 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace mole {
+
+// Size of a SOCKS5 request or reply, [VER CMD|REP RSV ATYP ADDR PORT], judged by its address
+// type. 0 if the address type is unknown or len is too short to hold the whole message.
+size_t socks_message_size(const uint8_t *data, size_t len);
+
+// The tunnel hello (local -> remote) and its reply carry the SOCKS message followed by
+// extensions, each [type, length, value...]. salt is required, the remote refuses a hello
+// without it, so both ends have to be of the same version; the others are optional.
+enum class hello_ext: uint8_t {
+    ciphers = 0x01,     // hello: bitmask of ciphers the local side can use
+    frame_size = 0x02,  // hello: largest frame payload the local side wants, 4 bytes big endian
+    salt = 0x03,        // hello, empty, required: the remote answers with a salt frame in the
+                        // clear first, see mole_crypto
+    cipher = 0x81,      // reply: the cipher picked by the remote
+    frame = 0x82,       // reply: agreed frame payload, switches the data frames to frame_format::v2
+};
+
+// Header in front of every tunnel frame, the length of the ciphertext that follows. v1 is
+// 2 bytes big endian; v2, used once both ends agreed on it in the hello, is LEB128 of up to
+// 3 bytes so frames can grow past 64 KiB. The hello and its reply always use v1.
+enum class frame_format: uint8_t {
+    v1,
+    v2,
+};
+
+constexpr size_t FRAME_HEADER_MAX = 3;
+constexpr size_t MIN_FRAME_SIZE = 1024;
+constexpr size_t MAX_FRAME_SIZE = 1024 * 1024;
+
+// writes the header for a frame of len bytes so that it ends right at `end`, returns its size
+size_t put_frame_header(frame_format fmt, size_t len, uint8_t *end);
+
+void append_ext(std::vector<uint8_t>& out, hello_ext type, const uint8_t *value, size_t len);
+
+// value of the first extension of the given type in [data, data + len), nullptr if absent
+const uint8_t *find_ext(const uint8_t *data, size_t len, hello_ext type, size_t& value_len);
+
+}
@@ -3,16 +3,68 @@
 namespace mole {
 
 remote_session::remote_session(asio::io_context& ctx):
-    local_socket_{ctx}, target_socket_{ctx}, target_resolver_{ctx},
-    local_buff_{}, target_buff_{}, local_received_{0},
-    crypto_{mole_cfg::self().key()} {
-    local_rx_data_.reserve(BUFF_SIZE);
-    local_tx_data_.reserve(BUFF_SIZE);
+    local_socket_{ctx}, target_socket_{ctx}, target_resolver_{ctx}, dns_{dns_resolver::of(ctx)},
+    local_reader_{PIPELINE_DEPTH * buffer_pool::BLOCK_SIZE, buffer_pool::BLOCK_SIZE},
+    local_writing_{false}, target_writing_{false}, local_paused_{false}, target_paused_{false},
+    local_eof_{false}, target_eof_{false},
+    negotiate_{false}, cipher_{mole_crypto::cipher::chacha20_poly1305},
+    format_{frame_format::v1}, frame_size_{BUFF_SIZE},
+    local_received_{0},
+    crypto_{nullptr, mole_crypto::role::remote},
+    timeout_{timer_wheel::of(ctx), [this]() {
+        spdlog::debug("timeout");
+        // the handlers cancelled by close() may hold the last references to the session
+        auto self = shared_from_this();
+        close();
+    }} {
+}
+
+void remote_session::reset() {
+    std::error_code ec;
+    timeout_.cancel();
+    local_socket_.close(ec);
+    target_socket_.close(ec);
+    if (target_connector_) {
+        target_connector_->cancel();
+        target_connector_.reset();
+    }
+    local_received_ = 0;
+    local_buff_.reset();
+    local_reader_.reset();
+    local_queue_.clear();
+    target_queue_.clear();
+    local_writing_ = false;
+    target_writing_ = false;
+    local_paused_ = false;
+    target_paused_ = false;
+    local_eof_ = false;
+    target_eof_ = false;
+    local_rx_data_.clear();
+    local_tx_data_.clear();
+    negotiate_ = false;
+    cipher_ = mole_crypto::cipher::chacha20_poly1305;
+    format_ = frame_format::v1;
+    frame_size_ = BUFF_SIZE;
+    crypto_.reset();
+}
+
+void remote_session::close() {
+    std::error_code ec;
+    local_socket_.close(ec);
+    target_socket_.close(ec);
+    if (target_connector_) {
+        target_connector_->cancel();
+        target_connector_.reset();
+    }
 }
 
 void remote_session::start() {
     spdlog::debug("start");
+    if (handshake_stats::enabled()) {
+        phase_start_ = handshake_stats::clock::now();
+    }
     local_socket_.non_blocking(true);
+    expire_after(mole_cfg::self().handshake_timeout());
     local_hello();
 }
 
@@ -21,8 +73,11 @@ void remote_session::local_receive(size_t expected, void (remote_session::*handl
         (this->*handler)();
         return;
     }
-    auto buff = local_buff_.data() + local_received_;
-    auto remain = BUFF_SIZE - local_received_;
+    if (!local_buff_) {
+        local_buff_ = buffer_pool::acquire();
+    }
+    auto buff = local_buff_.get() + local_received_;
+    auto remain = buffer_pool::BLOCK_SIZE - local_received_;
     auto self = shared_from_this();
     asio::async_read(local_socket_, asio::buffer(buff, remain), asio::transfer_at_least(expected - local_received_),
         [this, handler, self](const std::error_code& ec, size_t sz) {
@@ -43,6 +98,11 @@ void remote_session::local_hello() {
         return;
     }
     auto pl = static_cast<size_t>(local_buff_[nl] << 8u) | local_buff_[nl + 1];
+    // the whole hello has to fit in the one block it is read into
+    if (nl + 2 + pl > buffer_pool::BLOCK_SIZE) {
+        spdlog::debug("invalid hello");
+        return;
+    }
     if (local_received_ < pl + nl + 2) {
         local_receive(pl + nl + 2, &remote_session::local_command);
         return;
@@ -53,13 +113,71 @@ void remote_session::local_hello() {
 void remote_session::local_command() {
     auto nl = mole_crypto::nonce_size();
     size_t pl = static_cast<size_t>(local_buff_[nl] << 8u) | local_buff_[nl + 1];
-    crypto_.nonce(local_buff_.data());
+    if (pl < mole_crypto::extra_size()) {
+        spdlog::debug("invalid hello");
+        return;
+    }
     local_rx_data_.resize(pl - mole_crypto::extra_size());
-    auto ok = crypto_.decrypt(local_buff_.data() + nl + 2, pl, local_rx_data_.data());
+    auto ok = false;
+    for (auto&& key: key_manager::self().candidates(local_buff_.get())) {
+        if (!key) {
+            continue;
+        }
+        crypto_.key(key);
+        crypto_.nonce(local_buff_.get());
+        ok = crypto_.open_hello(local_buff_.get() + nl + 2, pl, local_rx_data_.data());
+        if (ok) {
+            break;
+        }
+    }
     if (!ok) {
         spdlog::debug("decrypt error");
         return;
     }
+    spdlog::debug("user: {}", crypto_.key()->user);
+    mark(handshake_stats::remote_hello);
+    auto cl = socks_message_size(local_rx_data_.data(), local_rx_data_.size());
+    if (cl == 0) {
+        spdlog::debug("invalid command");
+        return;
+    }
+    size_t vl = 0;
+    // peers from before the salted subkeys send no salt and could not read the reply anyway,
+    // both ends have to be updated together
+    if (find_ext(local_rx_data_.data() + cl, local_rx_data_.size() - cl, hello_ext::salt, vl) == nullptr) {
+        spdlog::warn("hello without salt, the peer is too old");
+        return;
+    }
+    // extensions follow the command, pick the fastest cipher both ends can use
+    // a hello offering none can use ChaCha20-Poly1305 only, without a common one it is refused
+    auto offered = static_cast<uint8_t>(mole_crypto::cipher::chacha20_poly1305);
+    const auto *v = find_ext(local_rx_data_.data() + cl, local_rx_data_.size() - cl, hello_ext::ciphers, vl);
+    if (v != nullptr && vl == 1) {
+        negotiate_ = true;
+        offered = v[0];
+    }
+    auto common = static_cast<uint8_t>(offered & mole_crypto::available() & mole_cfg::self().ciphers());
+    if (common == 0) {
+        spdlog::warn("no cipher in common, offered 0x{:02x}", offered);
+        return;
+    }
+    cipher_ = mole_crypto::pick(common);
+    v = find_ext(local_rx_data_.data() + cl, local_rx_data_.size() - cl, hello_ext::frame_size, vl);
+    if (v != nullptr && vl == 4) {
+        auto fs = static_cast<size_t>(v[0]) << 24u | static_cast<size_t>(v[1]) << 16u | static_cast<size_t>(v[2]) << 8u | v[3];
+        fs = std::min(fs, mole_cfg::self().max_frame());
+        if (fs >= MIN_FRAME_SIZE) {
+            // rounded down to a power of two, a peer can not make the buffer pools keep a list
+            // for every size it asks for
+            size_t p2 = MIN_FRAME_SIZE;
+            while (p2 * 2 <= fs) {
+                p2 *= 2;
+            }
+            format_ = frame_format::v2;
+            frame_size_ = p2;
+        }
+    }
+    local_rx_data_.resize(cl);
 
     auto addr_type = local_rx_data_[3];
     if (addr_type == 0x01) {
@@ -76,18 +194,21 @@ void remote_session::local_command() {
         const auto *pt = local_rx_data_.data() + 5 + dl;
         uint16_t port = static_cast<uint16_t>(pt[0] << 8u) | pt[1];
         auto domain = std::string{dm, pt};
-        spdlog::info("target: {}:{}", domain, port);
-        auto& dc = domain_cache::self();
-        auto rr = dc.get(domain);
-        if (rr.empty()) {
-            target_resolve(std::move(domain), port);
-        } else {
-            // replace port
-            for (auto& r: rr) {
-                r.port(port);
-            }
-            target_connect(rr);
+        if (!domain_cache::valid(domain)) {
+            spdlog::warn("invalid target name");
+            local_reply(0x04); // Host unreachable
+            return;
         }
+        spdlog::info("target: {}:{}", domain, port);
+        target_resolve(std::move(domain), port);
+    } else if (addr_type == 0x04) {
+        // ipv6
+        asio::ip::address_v6::bytes_type bytes;
+        std::copy(local_rx_data_.begin() + 4, local_rx_data_.begin() + 20, bytes.begin());
+        uint16_t port = static_cast<uint16_t>(local_rx_data_[20] << 8u) | local_rx_data_[21];
+        auto ip = asio::ip::address_v6{bytes};
+        spdlog::info("target: [{}]:{}", ip.to_string(), port);
+        target_connect({{ip, port}});
     } else {
         spdlog::warn("type 0x{:02x} NOT support", addr_type);
         local_reply(0x08); // Address type not supported
@@ -97,21 +218,53 @@ void remote_session::local_command() {
 
 void remote_session::local_reply(uint8_t reply) {
     local_rx_data_[1] = reply;
+    if (negotiate_) {
+        auto c = static_cast<uint8_t>(cipher_);
+        append_ext(local_rx_data_, hello_ext::cipher, &c, 1);
+    }
+    if (format_ == frame_format::v2) {
+        const uint8_t frame_size[4] = {
+            static_cast<uint8_t>(frame_size_ >> 24u), static_cast<uint8_t>(frame_size_ >> 16u),
+            static_cast<uint8_t>(frame_size_ >> 8u), static_cast<uint8_t>(frame_size_),
+        };
+        append_ext(local_rx_data_, hello_ext::frame, frame_size, sizeof(frame_size));
+    }
+    // a fresh salt goes first in the clear, the reply and every frame after it are sealed under
+    // the subkey over nonce and salt, so a replayed hello never reuses the keys of a session
+    constexpr size_t sl = mole_crypto::SALT_SIZE;
     auto pl = local_rx_data_.size() + mole_crypto::extra_size();
-    local_tx_data_.resize(pl + 2);
-    crypto_.encrypt(local_rx_data_.data(), local_rx_data_.size(), local_tx_data_.data() + 2);
-    local_tx_data_[0] = pl >> 8u;
-    local_tx_data_[1] = pl & 0xffu;
+    local_tx_data_.resize(2 + sl + 2 + pl);
+    local_tx_data_[0] = 0;
+    local_tx_data_[1] = sl;
+    mole_crypto::random_salt(local_tx_data_.data() + 2);
+    crypto_.salt(local_tx_data_.data() + 2);
+    crypto_.encrypt(local_rx_data_.data(), local_rx_data_.size(), local_tx_data_.data() + 2 + sl + 2);
+    local_tx_data_[2 + sl] = pl >> 8u;
+    local_tx_data_[2 + sl + 1] = pl & 0xffu;
     auto self = shared_from_this();
     asio::async_write(local_socket_, asio::buffer(local_tx_data_), [this, self](const std::error_code& ec, std::size_t) {
         if (ec) {
             spdlog::debug("local_reply error: {}", ec.message());
             return;
         }
+        mark(handshake_stats::remote_reply);
 
-        spdlog::debug("stream");
+        // the reply itself went out under ChaCha20-Poly1305, the data frames use the agreed cipher
+        crypto_.use(cipher_);
+        spdlog::debug("stream, cipher: {}, frame: {}", mole_crypto::name(cipher_), frame_size_);
+        local_reader_.configure(PIPELINE_DEPTH * (frame_size_ + buffer_pool::HEADROOM),
+            frame_size_ + buffer_pool::HEADROOM, format_);
 
+        // frames sent right behind the hello are already in the handshake buffer
+        auto nl = mole_crypto::nonce_size();
+        auto hl = nl + 2 + (static_cast<size_t>(local_buff_[nl] << 8u) | local_buff_[nl + 1]);
+        if (local_received_ > hl) {
+            local_reader_.append(local_buff_.get() + hl, local_received_ - hl);
+        }
+        local_buff_.reset();
         local_received_ = 0;
+        timeout_.cancel();
+        touch();
         local_stream();
 
         target_stream();
@@ -120,100 +273,336 @@ void remote_session::local_reply(uint8_t reply) {
 
 
 void remote_session::local_stream() {
-    if (local_received_ == 0) {
-        local_receive(2 + mole_crypto::extra_size(), &remote_session::local_stream);
-        return;
+    // decrypt every complete frame already buffered, in place
+    frame_reader::frame f{};
+    auto r = frame_reader::result::partial;
+    while (target_queue_.size() < PIPELINE_DEPTH && (r = local_reader_.next(f)) == frame_reader::result::frame) {
+        if (crypto_pool::self().offload(f.size - std::min(f.size, mole_crypto::extra_size()))) {
+            // opened by a worker, written once it and everything queued before it is done
+            target_queue_.push_back({f.data, f.size - mole_crypto::extra_size(), f.end, false});
+            auto& w = target_queue_.back();
+            auto self = shared_from_this();
+            crypto_pool::self().post(target_socket_.get_executor(),
+                [this, f, counter = crypto_.next_rx()]() {
+                    return crypto_.open(counter, f.data, f.size, f.data);
+                },
+                [this, self, &w](bool ok) {
+                    if (!ok) {
+                        spdlog::error("decrypt error");
+                        close();
+                        return;
+                    }
+                    w.ready = true;
+                    target_flush();
+                });
+            continue;
+        }
+        auto ok = crypto_.decrypt(f.data, f.size, f.data);
+        if (!ok) {
+            spdlog::error("decrypt error");
+            close();
+            return;
+        }
+        target_queue_.push_back({f.data, f.size - mole_crypto::extra_size(), f.end});
     }
-    size_t pl = static_cast<size_t>(local_buff_[0] << 8u) | local_buff_[1];
-    if (local_received_ < pl + 2) {
-        local_receive(pl + 2, &remote_session::local_stream);
+    target_flush();
+    if (r == frame_reader::result::invalid) {
+        spdlog::error("invalid frame");
+        close();
         return;
     }
-    local_rx_data_.resize(pl - mole_crypto::extra_size());
-    auto ok = crypto_.decrypt(local_buff_.data() + 2, pl, local_rx_data_.data());
-    if (!ok) {
-        spdlog::error("decrypt error");
+    if (r == frame_reader::result::frame || r == frame_reader::result::blocked || local_reader_.full()) {
+        // resumed by target_flush
+        local_paused_ = true;
         return;
     }
 
-    local_received_ -= (pl + 2);
-    if (local_received_ > 0) {
-        std::memmove(local_buff_.data(), local_buff_.data() + pl + 2, local_received_);
+    if (local_reader_.empty()) {
+        // nothing buffered, the ring stays in the pool until the next frame shows up
+        local_reader_.shrink();
+        auto self = shared_from_this();
+        local_socket_.async_wait(tcp::socket::wait_read, [this, self](const std::error_code& ec) {
+            if (ec) {
+                spdlog::debug("local_stream async_wait error: {}", ec.message());
+                return;
+            }
+            local_read();
+        });
+        return;
     }
+    local_read();
+}
 
+void remote_session::local_read() {
     auto self = shared_from_this();
-    asio::async_write(target_socket_, asio::buffer(local_rx_data_), [this, self](const std::error_code& ec, std::size_t sz) {
+    local_socket_.async_read_some(local_reader_.prepare(), [this, self](const std::error_code& ec, std::size_t sz) {
         if (ec) {
-            spdlog::debug("local_stream async_write error: {}", ec.message());
+            spdlog::debug("local_read error: {}", ec.message());
+            if (ec == asio::error::eof) {
+                local_eof_ = true;
+                target_flush();
+            } else if (ec != asio::error::operation_aborted) {
+                close();
+            }
             return;
         }
-        spdlog::debug("target_socket_ async_write: {}", sz);
+        // every read pushes the idle timeout back, a bulk upload rarely leaves the ring empty
+        touch();
+        local_reader_.commit(sz);
         local_stream();
     });
 }
 
-void remote_session::target_resolve(std::string&& domain, uint16_t port) {
+void remote_session::local_flush() {
+    if (local_writing_) {
+        return;
+    }
+    // everything ready so far goes out in one gather write
+    auto n = ready_count(local_queue_);
+    if (n == 0) {
+        if (target_eof_ && local_queue_.empty()) {
+            // everything before the EOF is written, pass it on
+            std::error_code ec;
+            local_socket_.shutdown(tcp::socket::shutdown_send, ec);
+        }
+        return;
+    }
+    local_writing_ = true;
     auto self = shared_from_this();
-    target_resolver_.async_resolve(domain, std::to_string(port),
-        [this, self](const std::error_code& ec, const tcp::resolver::results_type& endpoints) {
+    asio::async_write(local_socket_, gather<PIPELINE_DEPTH>(local_queue_, n), [this, self, n](const std::error_code& ec, std::size_t) {
         if (ec) {
-            spdlog::debug("target_resolve error: {}", ec.message());
-            local_reply(0x04); // Host unreachable
+            spdlog::debug("local_flush async_write error: {}", ec.message());
+            close();
             return;
         }
-#if MOLE_DEBUG
-        for (auto&& ep: endpoints) {
-            auto&& x = ep.endpoint();
-            spdlog::debug("resolve result: {}", x.address().to_string(), x.port());
+        local_writing_ = false;
+        local_queue_.erase(local_queue_.begin(), local_queue_.begin() + n);
+        if (target_paused_) {
+            target_paused_ = false;
+            target_stream();
         }
-#endif
-        std::vector<tcp::endpoint> vv;
+        local_flush();
+    });
+}
+
+void remote_session::target_resolve(std::string&& domain, uint16_t port) {
+    auto& dc = domain_cache::self();
+    auto self = shared_from_this();
+    domain_cache::endpoint_vector rr;
+    auto st = dc.query(domain, rr, local_socket_.get_executor(),
+        [this, self, domain, port](const std::error_code& ec, const domain_cache::endpoint_vector& endpoints) {
+        // resolved by another session
+        if (!local_socket_.is_open()) {
+            return;
+        }
+        if (ec == asio::error::operation_aborted) {
+            // its lookup was given up, try on our own
+            target_resolve(std::string{domain}, port);
+            return;
+        }
+        mark(handshake_stats::remote_resolve);
+        target_resolved(endpoints, port);
+    });
+    if (st == domain_cache::status::wait) {
+        return;
+    }
+    if (st == domain_cache::status::resolve) {
+        target_lookup(domain, port, false);
+        return;
+    }
+    mark(handshake_stats::remote_resolve);
+    if (st == domain_cache::status::refresh) {
+        // the cached endpoints are used meanwhile, the lookup only renews them
+        target_lookup(domain, port, true);
+    }
+    target_resolved(std::move(rr), port);
+}
+
+void remote_session::target_lookup(const std::string& domain, uint16_t port, bool background) {
+    spdlog::debug("target_lookup {}, background={}", domain, background);
+    auto self = shared_from_this();
+    if (dns_resolver::enabled()) {
+        dns_.resolve(domain, [this, self, domain, port, background](const std::error_code& ec,
+            const dns_resolver::address_vector& addrs, std::chrono::seconds ttl) {
+            domain_cache::endpoint_vector vv;
+            for (auto& a: addrs) {
+                vv.emplace_back(a, port);
+            }
+            target_resolve_done(domain, ec, vv, ttl, background);
+        });
+        return;
+    }
+    target_resolver_.async_resolve(domain, std::to_string(port),
+        [this, self, domain, background](const std::error_code& ec, const tcp::resolver::results_type& endpoints) {
+        domain_cache::endpoint_vector vv;
         for (auto& ep: endpoints) {
             vv.push_back(ep.endpoint());
         }
-        target_connect(vv);
+        // getaddrinfo does not tell the TTL of the records
+        target_resolve_done(domain, ec, vv, std::chrono::seconds(mole_cfg::self().dns_ttl()), background);
     });
 }
 
+void remote_session::target_resolve_done(const std::string& domain, const std::error_code& ec,
+    const domain_cache::endpoint_vector& endpoints, std::chrono::seconds ttl, bool background) {
+    auto& dc = domain_cache::self();
+    if (!background) {
+        mark(handshake_stats::remote_resolve);
+    }
+    if (ec) {
+        spdlog::debug("target_resolve error: {}", ec.message());
+        // server failures are remembered too (RFC 2308), the name is asked again soon anyway
+        dc.fail(domain, ec, ec != asio::error::operation_aborted);
+        if (!background && local_socket_.is_open()) {
+            local_reply(0x04); // Host unreachable
+        }
+        return;
+    }
+#if MOLE_DEBUG
+    for (auto&& x: endpoints) {
+        spdlog::debug("resolve result: {}:{}", x.address().to_string(), x.port());
+    }
+#endif
+    dc.set(domain, endpoints, ttl);
+    if (!background && local_socket_.is_open()) {
+        target_connect(endpoints);
+    }
+}
+
+void remote_session::target_resolved(domain_cache::endpoint_vector endpoints, uint16_t port) {
+    if (endpoints.empty()) {
+        local_reply(0x04); // Host unreachable
+        return;
+    }
+    // cached without the port
+    for (auto& ep: endpoints) {
+        ep.port(port);
+    }
+    target_connect(endpoints);
+}
+
 void remote_session::target_connect(const std::vector<tcp::endpoint>& endpoints) {
+    auto& cfg = mole_cfg::self();
+    target_connector_ = std::make_shared<connector>(target_socket_.get_executor(),
+        std::chrono::milliseconds(cfg.connect_delay()), std::chrono::milliseconds(cfg.connect_timeout()));
     auto self = shared_from_this();
-    asio::async_connect(target_socket_, endpoints, [this, self](const std::error_code& ec, const tcp::endpoint&){
+    target_connector_->start(endpoints, [this, self](const std::error_code& ec, tcp::socket&& socket) {
+        target_connector_.reset();
+        mark(handshake_stats::remote_connect);
         if (ec) {
             spdlog::debug("target_connect error: {}", ec.message());
             local_reply(0x03); // Network unreachable
             return;
         }
         spdlog::debug("target connected");
+        target_socket_ = std::move(socket);
         target_socket_.non_blocking(true);
         local_reply(0x00); // succeeded
     });
 }
 
 void remote_session::target_stream() {
+    // idle connections hold no buffer, one is borrowed once the socket turns readable
     auto self = shared_from_this();
-    target_socket_.async_read_some(asio::buffer(target_buff_), [this, self](const std::error_code& ec, std::size_t sz) {
+    target_socket_.async_wait(tcp::socket::wait_read, [this, self](const std::error_code& ec) {
         if (ec) {
-            spdlog::debug("target_stream async_read_some error: {}", ec.message());
+            spdlog::debug("target_stream async_wait error: {}", ec.message());
             return;
         }
-        spdlog::debug("target_socket_ async_read_some: {}", sz);
-        auto pl = sz + mole_crypto::extra_size();
-        local_tx_data_.resize(pl + 2);
-        auto ok = crypto_.encrypt(target_buff_.data(), sz, local_tx_data_.data() + 2);
-        if (!ok) {
-            spdlog::error("encrypt error");
+        touch();
+        // drain what is readable up to the pipeline depth, it all goes out in one write
+        while (local_queue_.size() < PIPELINE_DEPTH) {
+            auto buff = buffer_pool::acquire(frame_size_ + buffer_pool::HEADROOM);
+            std::error_code rec;
+            // leave room for the header in front, the tag follows the data
+            auto *data = buff.get() + FRAME_HEADER_MAX;
+            auto sz = target_socket_.read_some(asio::buffer(data, frame_size_), rec);
+            if (rec == asio::error::would_block) {
+                break;
+            }
+            if (rec) {
+                spdlog::debug("target_stream read_some error: {}", rec.message());
+                if (rec != asio::error::eof) {
+                    close();
+                    return;
+                }
+                // the rest still goes out, then the EOF is passed on
+                target_eof_ = true;
+                local_flush();
+                return;
+            }
+            spdlog::debug("target_socket_ read_some: {}", sz);
+            auto pl = sz + mole_crypto::extra_size();
+            auto hl = put_frame_header(format_, pl, data);
+            local_queue_.push_back({std::move(buff), FRAME_HEADER_MAX - hl, pl + hl});
+            if (crypto_pool::self().offload(sz)) {
+                // sealed by a worker, written once it and everything queued before it is done
+                auto& w = local_queue_.back();
+                w.ready = false;
+                crypto_pool::self().post(local_socket_.get_executor(),
+                    [this, data, sz, counter = crypto_.next_tx()]() {
+                        return crypto_.seal(counter, data, sz, data);
+                    },
+                    [this, self, &w](bool ok) {
+                        if (!ok) {
+                            spdlog::error("encrypt error");
+                            close();
+                            return;
+                        }
+                        w.ready = true;
+                        local_flush();
+                    });
+            } else if (!crypto_.encrypt(data, sz, data)) {
+                spdlog::error("encrypt error");
+                close();
+                return;
+            }
+            if (sz < frame_size_) {
+                break;
+            }
+        }
+
+        local_flush();
+        if (local_queue_.size() >= PIPELINE_DEPTH) {
+            // resumed by local_flush
+            target_paused_ = true;
             return;
         }
-        local_tx_data_[0] = pl >> 8u;
-        local_tx_data_[1] = pl & 0xffu;
+        target_stream();
+    });
+}
 
-        asio::async_write(local_socket_, asio::buffer(local_tx_data_), [this, self](const std::error_code& ec, std::size_t) {
-            if (ec) {
-                spdlog::debug("target_stream async_write error: {}", ec.message());
-                return;
-            }
-            target_stream();
-        });
+void remote_session::target_flush() {
+    if (target_writing_) {
+        return;
+    }
+    // everything ready so far goes out in one gather write
+    auto n = ready_count(target_queue_);
+    if (n == 0) {
+        if (local_eof_ && target_queue_.empty()) {
+            // everything before the EOF is written, pass it on
+            std::error_code ec;
+            target_socket_.shutdown(tcp::socket::shutdown_send, ec);
+        }
+        return;
+    }
+    target_writing_ = true;
+    auto self = shared_from_this();
+    asio::async_write(target_socket_, gather<PIPELINE_DEPTH>(target_queue_, n), [this, self, n](const std::error_code& ec, std::size_t sz) {
+        if (ec) {
+            spdlog::debug("target_flush async_write error: {}", ec.message());
+            close();
+            return;
+        }
+        spdlog::debug("target_socket_ async_write: {}", sz);
+        target_writing_ = false;
+        local_reader_.release(target_queue_[n - 1].end);
+        target_queue_.erase(target_queue_.begin(), target_queue_.begin() + n);
+        if (local_paused_) {
+            local_paused_ = false;
+            local_stream();
+        }
+        target_flush();
     });
 }
 
@@ -1,7 +1,18 @@
 #pragma once
 
+#include "buffer_pool.hpp"
+#include "connector.hpp"
+#include "crypto_pool.hpp"
+#include "dns_resolver.hpp"
+#include "domain_cache.hpp"
+#include "frame_reader.hpp"
+#include "handshake_stats.hpp"
+#include "key_manager.hpp"
 #include "mole_crypto.hpp"
+#include "proto.hpp"
+#include "timer_wheel.hpp"
 #include "utils.hpp"
+#include "write_queue.hpp"
 
 namespace mole {
 
@@ -21,34 +32,96 @@ public:
 
     void start();
 
+    // back to the freshly constructed state, called by session_pool before reuse
+    void reset();
+
 private:
     void local_receive(size_t expected, void (remote_session::*handler)());
 
+    // closes both sockets, which ends every pending operation and so the session
+    void close();
+
+    // restarts the timeout with that many seconds, 0 is none
+    void expire_after(size_t seconds) {
+        if (seconds > 0) {
+            timeout_.arm(std::chrono::seconds(seconds));
+        } else {
+            timeout_.cancel();
+        }
+    }
+
+    // the tunnel saw traffic, pushes the idle timeout back
+    void touch() {
+        expire_after(mole_cfg::self().idle_timeout());
+    }
+
+    void mark(handshake_stats::phase p) {
+        if (handshake_stats::enabled()) {
+            handshake_stats::self().mark(p, phase_start_);
+        }
+    }
+
     void local_hello();
     void local_command();
     void local_reply(uint8_t reply);
     void local_stream();
+    void local_read();
+    void local_flush();
 
     void target_resolve(std::string&& domain, uint16_t port);
+    // background: a refresh of a cached name, the session is not waiting for it
+    void target_lookup(const std::string& domain, uint16_t port, bool background);
+    void target_resolve_done(const std::string& domain, const std::error_code& ec,
+        const domain_cache::endpoint_vector& endpoints, std::chrono::seconds ttl, bool background);
+    void target_resolved(domain_cache::endpoint_vector endpoints, uint16_t port);
     void target_connect(const std::vector<tcp::endpoint>& endpoints);
     void target_stream();
+    void target_flush();
 
 private:
     tcp::socket local_socket_;
     tcp::socket target_socket_;
     tcp::resolver target_resolver_;
+    dns_resolver& dns_;
+    std::shared_ptr<connector> target_connector_;
 
     static constexpr size_t BUFF_SIZE = 1024 * 32;
 
-    std::array<uint8_t, BUFF_SIZE> local_buff_;
-    std::array<uint8_t, BUFF_SIZE> target_buff_;
+    // chunks a direction may have queued before its reader pauses
+    static constexpr size_t PIPELINE_DEPTH = 4;
+
+    // borrowed from buffer_pool only while data is in flight
+    buffer_pool::buffer local_buff_;
+    frame_reader local_reader_;
+
+    // each stream keeps reading while the previous chunks are still being written
+    std::deque<pending_write> local_queue_;
+    std::deque<pending_frame> target_queue_;
+    bool local_writing_;
+    bool target_writing_;
+    bool local_paused_;
+    bool target_paused_;
+    // EOF read on that socket, passed on once the other queue is written
+    bool local_eof_;
+    bool target_eof_;
 
     std::vector<uint8_t> local_rx_data_;
     std::vector<uint8_t> local_tx_data_;
+    // cipher for the data frames, answered only to a hello that offered some
+    bool negotiate_;
+    mole_crypto::cipher cipher_;
+    // framing of the data frames, v2 once the hello asked for it
+    frame_format format_;
+    size_t frame_size_;
 
     size_t local_received_;
 
     mole_crypto crypto_;
+
+    handshake_stats::clock::time_point phase_start_;
+
+    // handshake, then idle timeout, on the wheel of the session's context
+    timer_wheel::entry timeout_;
 };
 
 }
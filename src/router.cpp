@@ -0,0 +1,391 @@
+#include <deque>
+#include <fstream>
+#include <sstream>
+
+#include "router.hpp"
+
+namespace mole {
+
+namespace {
+
+bool parse_action(const std::string& s, router::action& a) {
+    if (s == "tunnel") {
+        a = router::action::tunnel;
+    } else if (s == "direct") {
+        a = router::action::direct;
+    } else if (s == "reject") {
+        a = router::action::reject;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+std::string lower(std::string_view s) {
+    std::string rr{s};
+    for (auto& c: rr) {
+        if (c >= 'A' && c <= 'Z') {
+            c = static_cast<char>(c - 'A' + 'a');
+        }
+    }
+    return rr;
+}
+
+}
+
+router& router::self() {
+    static router r;
+    return r;
+}
+
+const char *router::name(action a) {
+    switch (a) {
+    case action::tunnel:
+        return "tunnel";
+    case action::direct:
+        return "direct";
+    case action::reject:
+        return "reject";
+    }
+    return "";
+}
+
+bool router::load(const std::string& path) {
+    std::ifstream ifs{path};
+    if (!ifs) {
+        spdlog::error("can NOT open rules file {}", path);
+        return false;
+    }
+    return load(ifs, path);
+}
+
+bool router::load(std::istream& is, const std::string& name) {
+    matchers mm;
+    std::string line;
+    uint32_t lineno = 0;
+    size_t n = 0;
+    while (std::getline(is, line)) {
+        ++lineno;
+        auto p = line.find('#');
+        if (p != std::string::npos) {
+            line.resize(p);
+        }
+        std::istringstream iss{line};
+        std::string kind, value, act, extra;
+        if (!(iss >> kind)) {
+            continue;
+        }
+        match m{action::tunnel, lineno};
+        if (kind == "default") {
+            if (!(iss >> act) || (iss >> extra) || !parse_action(act, m.act)) {
+                spdlog::error("{}:{}: expected \"default tunnel|direct|reject\"", name, lineno);
+                return false;
+            }
+            mm.fallback = m;
+            continue;
+        }
+        if (!(iss >> value >> act) || (iss >> extra)) {
+            spdlog::error("{}:{}: expected \"kind value action\"", name, lineno);
+            return false;
+        }
+        if (!parse_action(act, m.act)) {
+            spdlog::error("{}:{}: unknown action {}", name, lineno, act);
+            return false;
+        }
+        auto ok = true;
+        if (kind == "domain" || kind == "suffix") {
+            ok = add_domain(mm, lower(value), kind == "suffix", m);
+        } else if (kind == "keyword") {
+            add_keyword(mm, lower(value), m);
+        } else if (kind == "cidr") {
+            auto slash = value.find('/');
+            std::error_code ec;
+            auto addr = asio::ip::make_address(value.substr(0, slash), ec);
+            size_t bits = addr.is_v4() ? 32 : 128;
+            auto len = bits;
+            if (!ec && slash != std::string::npos) {
+                auto ls = value.substr(slash + 1);
+                ok = !ls.empty() && ls.size() <= 3 && ls.find_first_not_of("0123456789") == std::string::npos;
+                len = ok ? std::stoul(ls) : 0;
+            }
+            ok = ok && !ec && len <= bits;
+            if (ok) {
+                add_prefix(mm, bytes_of(addr), static_cast<uint8_t>(len + 128 - bits), m);
+            }
+        } else {
+            spdlog::error("{}:{}: unknown kind {}", name, lineno, kind);
+            return false;
+        }
+        if (!ok) {
+            spdlog::error("{}:{}: bad {} {}", name, lineno, kind, value);
+            return false;
+        }
+        ++n;
+    }
+    build_keywords(mm);
+    // loaded before the sessions start, read only afterwards
+    mm_ = std::move(mm);
+    rules_ = n;
+    spdlog::info("{} rules loaded from {}, default {}", n, name, router::name(mm_.fallback.act));
+    return true;
+}
+
+router::action router::route(const std::string& domain) const {
+    if (rules_ == 0) {
+        return mm_.fallback.act;
+    }
+    std::error_code ec;
+    auto addr = asio::ip::make_address(domain, ec);
+    if (!ec) {
+        return route(addr);
+    }
+    auto name = lower(domain);
+    if (!name.empty() && name.back() == '.') {
+        name.pop_back();
+    }
+    auto m = lookup(name);
+    if (m.line != 0) {
+        return m.act;
+    }
+    if (!mm_.next.empty()) {
+        uint32_t state = 0;
+        for (unsigned char c: name) {
+            for (;;) {
+                auto it = mm_.next.find(static_cast<uint64_t>(state) << 8u | c);
+                if (it != mm_.next.end()) {
+                    state = it->second;
+                    break;
+                }
+                if (state == 0) {
+                    break;
+                }
+                state = mm_.fail[state];
+            }
+            auto& f = mm_.found[state];
+            if (f.line != 0 && (m.line == 0 || f.line < m.line)) {
+                m = f;
+            }
+        }
+        if (m.line != 0) {
+            return m.act;
+        }
+    }
+    return mm_.fallback.act;
+}
+
+router::action router::route(const asio::ip::address& addr) const {
+    auto& pp = mm_.prefixes;
+    if (rules_ == 0 || (pp.size() == 1 && pp[0].m.line == 0)) {
+        return mm_.fallback.act;
+    }
+    auto a = bytes_of(addr);
+    auto best = pp[0].m;
+    uint32_t n = 0;
+    while (pp[n].len < 128) {
+        auto c = pp[n].child[bit(a, pp[n].len)];
+        if (c == 0 || common_bits(a, pp[c].prefix, pp[c].len) < pp[c].len) {
+            break;
+        }
+        n = c;
+        if (pp[n].m.line != 0) {
+            best = pp[n].m;
+        }
+    }
+    return best.line != 0 ? best.act : mm_.fallback.act;
+}
+
+router::match router::lookup(std::string_view name) const {
+    // labels from the last one, the deepest suffix rule on the way wins
+    match best;
+    uint32_t node = 0;
+    auto end = name.size();
+    while (end > 0) {
+        auto dot = name.rfind('.', end - 1);
+        auto begin = dot == std::string_view::npos ? 0 : dot + 1;
+        auto it = mm_.edges.find({node, name.substr(begin, end - begin)});
+        if (it == mm_.edges.end()) {
+            break;
+        }
+        node = it->second;
+        auto& nn = mm_.nodes[node];
+        if (begin == 0 && nn.exact.line != 0) {
+            return nn.exact;
+        }
+        if (nn.suffix.line != 0) {
+            best = nn.suffix;
+        }
+        if (begin == 0) {
+            break;
+        }
+        end = dot;
+    }
+    return best;
+}
+
+bool router::add_domain(matchers& mm, std::string_view name, bool suffix, match m) {
+    if (suffix && !name.empty() && name.front() == '.') {
+        name.remove_prefix(1);
+    }
+    if (!name.empty() && name.back() == '.') {
+        name.remove_suffix(1);
+    }
+    if (name.empty()) {
+        return false;
+    }
+    uint32_t node = 0;
+    auto end = name.size();
+    for (;;) {
+        auto dot = name.rfind('.', end - 1);
+        auto begin = dot == std::string_view::npos ? 0 : dot + 1;
+        if (begin == end) {
+            return false;
+        }
+        const auto& label = *mm.labels.emplace(name.substr(begin, end - begin)).first;
+        auto it = mm.edges.find({node, label});
+        if (it == mm.edges.end()) {
+            auto child = static_cast<uint32_t>(mm.nodes.size());
+            mm.nodes.emplace_back();
+            it = mm.edges.emplace(label_key{node, label}, child).first;
+        }
+        node = it->second;
+        if (begin == 0) {
+            break;
+        }
+        end = dot;
+        if (end == 0) {
+            return false;
+        }
+    }
+    // the first rule of a name in the file wins
+    auto& target = suffix ? mm.nodes[node].suffix : mm.nodes[node].exact;
+    if (target.line == 0) {
+        target = m;
+    }
+    return true;
+}
+
+void router::add_keyword(matchers& mm, std::string_view word, match m) {
+    uint32_t state = 0;
+    for (unsigned char c: word) {
+        auto key = static_cast<uint64_t>(state) << 8u | c;
+        auto it = mm.next.find(key);
+        if (it == mm.next.end()) {
+            auto s = static_cast<uint32_t>(mm.fail.size());
+            mm.fail.push_back(0);
+            mm.found.emplace_back();
+            it = mm.next.emplace(key, s).first;
+        }
+        state = it->second;
+    }
+    if (mm.found[state].line == 0) {
+        mm.found[state] = m;
+    }
+}
+
+void router::build_keywords(matchers& mm) {
+    std::vector<std::vector<std::pair<uint8_t, uint32_t>>> children(mm.fail.size());
+    for (auto& [key, s]: mm.next) {
+        children[key >> 8u].emplace_back(static_cast<uint8_t>(key & 0xffu), s);
+    }
+    // breadth first, so the failure target of a state is done before it
+    std::deque<uint32_t> todo;
+    for (auto& [c, s]: children[0]) {
+        mm.fail[s] = 0;
+        todo.push_back(s);
+    }
+    while (!todo.empty()) {
+        auto u = todo.front();
+        todo.pop_front();
+        for (auto& [c, v]: children[u]) {
+            auto f = mm.fail[u];
+            for (;;) {
+                auto it = mm.next.find(static_cast<uint64_t>(f) << 8u | c);
+                if (it != mm.next.end()) {
+                    mm.fail[v] = it->second;
+                    break;
+                }
+                if (f == 0) {
+                    mm.fail[v] = 0;
+                    break;
+                }
+                f = mm.fail[f];
+            }
+            auto& inherited = mm.found[mm.fail[v]];
+            if (inherited.line != 0 && (mm.found[v].line == 0 || inherited.line < mm.found[v].line)) {
+                mm.found[v] = inherited;
+            }
+            todo.push_back(v);
+        }
+    }
+}
+
+void router::add_prefix(matchers& mm, const address_bytes& addr, uint8_t len, match m) {
+    auto masked = [](address_bytes a, size_t bits) {
+        for (size_t i = 0; i < a.size(); ++i) {
+            if (bits >= (i + 1) * 8) {
+                continue;
+            }
+            a[i] &= bits > i * 8 ? static_cast<uint8_t>(0xffu << (8 - (bits - i * 8))) : 0;
+        }
+        return a;
+    };
+    auto& pp = mm.prefixes;
+    uint32_t n = 0;
+    for (;;) {
+        if (pp[n].len == len) {
+            if (pp[n].m.line == 0) {
+                pp[n].m = m;
+            }
+            return;
+        }
+        auto b = bit(addr, pp[n].len);
+        auto c = pp[n].child[b];
+        if (c == 0) {
+            auto leaf = static_cast<uint32_t>(pp.size());
+            pp.push_back({masked(addr, len), len, {}, m});
+            pp[n].child[b] = leaf;
+            return;
+        }
+        auto cl = common_bits(addr, pp[c].prefix, std::min(len, pp[c].len));
+        if (cl == pp[c].len) {
+            n = c;
+            continue;
+        }
+        // the new prefix parts from c after cl bits, a node there takes both
+        auto x = static_cast<uint32_t>(pp.size());
+        pp.push_back({masked(addr, cl), static_cast<uint8_t>(cl), {}, cl == len ? m : match{}});
+        pp[x].child[bit(pp[c].prefix, cl)] = c;
+        if (cl < len) {
+            auto leaf = static_cast<uint32_t>(pp.size());
+            pp.push_back({masked(addr, len), len, {}, m});
+            pp[x].child[bit(addr, cl)] = leaf;
+        }
+        pp[n].child[b] = x;
+        return;
+    }
+}
+
+router::address_bytes router::bytes_of(const asio::ip::address& addr) {
+    if (addr.is_v6()) {
+        return addr.to_v6().to_bytes();
+    }
+    // v4-mapped, ::ffff:a.b.c.d
+    address_bytes a{};
+    a[10] = 0xffu;
+    a[11] = 0xffu;
+    auto v4 = addr.to_v4().to_bytes();
+    std::copy(v4.begin(), v4.end(), a.begin() + 12);
+    return a;
+}
+
+size_t router::common_bits(const address_bytes& a, const address_bytes& b, size_t limit) {
+    for (size_t i = 0; i < a.size() && i * 8 < limit; ++i) {
+        auto x = static_cast<unsigned>(a[i] ^ b[i]);
+        if (x != 0) {
+            return std::min<size_t>(i * 8 + __builtin_clz(x) - 24, limit);
+        }
+    }
+    return std::min<size_t>(limit, 128);
+}
+
+}
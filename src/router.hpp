@@ -0,0 +1,122 @@
+#pragma once
+
+#include <array>
+#include <istream>
+#include <string_view>
+#include <unordered_map>
+#include <unordered_set>
+
+#include "utils.hpp"
+
+namespace mole {
+
+// Local: decides per CONNECT whether the target goes through the tunnel, straight from this
+// host, or is refused. Rules are compiled once at startup into matchers whose cost does not
+// grow with their number:
+//  - domain and suffix rules in a trie over the labels of the name, last label first,
+//  - keyword rules in an Aho-Corasick automaton,
+//  - CIDR rules in a path-compressed binary radix tree, IPv4 as v4-mapped IPv6.
+// An exact domain beats the longest matching suffix, which beats the first keyword of the file
+// found in the name. Addresses take the longest matching prefix. Names are not resolved for
+// the CIDR rules, so no name is sent to the local DNS unless its rule says direct.
+class router {
+public:
+    enum class action: uint8_t {
+        tunnel,
+        direct,
+        reject,
+    };
+
+    static router& self();
+
+    router(const router&) = delete;
+    router(router&&) = delete;
+
+    // rules file, "kind value action" per line, # starts a comment; kind is domain, suffix,
+    // keyword or cidr, action tunnel, direct or reject; "default action" sets the action of
+    // targets no rule matches, tunnel if absent. Nothing changes unless every line is good.
+    bool load(const std::string& path);
+    bool load(std::istream& is, const std::string& name);
+
+    action route(const std::string& domain) const;
+    action route(const asio::ip::address& addr) const;
+
+    size_t size() const {
+        return rules_;
+    }
+
+    static const char *name(action a);
+
+private:
+    router() = default;
+
+    // the rule that matched, line 0 is none
+    struct match {
+        action act = action::tunnel;
+        uint32_t line = 0;
+    };
+
+    struct label_key {
+        uint32_t parent;
+        std::string_view label;
+
+        bool operator==(const label_key& o) const {
+            return parent == o.parent && label == o.label;
+        }
+    };
+
+    struct label_hash {
+        size_t operator()(const label_key& k) const {
+            return std::hash<std::string_view>{}(k.label) * 31 + k.parent;
+        }
+    };
+
+    struct label_node {
+        match exact;
+        match suffix;
+    };
+
+    using address_bytes = std::array<uint8_t, 16>;
+
+    struct prefix_node {
+        address_bytes prefix{};
+        uint8_t len = 0;
+        std::array<uint32_t, 2> child{};    // 0 is none, the root is never a child
+        match m;
+    };
+
+    struct matchers {
+        // the labels are interned, the edges of the trie view them
+        std::unordered_set<std::string> labels;
+        std::unordered_map<label_key, uint32_t, label_hash> edges;
+        std::vector<label_node> nodes{1};
+
+        // keywords: goto function keyed by state << 8 | byte, failure links, and the first
+        // keyword ending at each state or any of its suffixes
+        std::unordered_map<uint64_t, uint32_t> next;
+        std::vector<uint32_t> fail{0};
+        std::vector<match> found{1};
+
+        std::vector<prefix_node> prefixes{1};
+
+        match fallback;
+    };
+
+    static bool add_domain(matchers& mm, std::string_view name, bool suffix, match m);
+    static void add_keyword(matchers& mm, std::string_view word, match m);
+    static void build_keywords(matchers& mm);
+    static void add_prefix(matchers& mm, const address_bytes& addr, uint8_t len, match m);
+
+    static address_bytes bytes_of(const asio::ip::address& addr);
+    static bool bit(const address_bytes& a, size_t i) {
+        return (a[i / 8] >> (7 - i % 8)) & 1u;
+    }
+    static size_t common_bits(const address_bytes& a, const address_bytes& b, size_t limit);
+
+    match lookup(std::string_view name) const;
+
+    matchers mm_;
+    size_t rules_ = 0;
+};
+
+}
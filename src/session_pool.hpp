@@ -0,0 +1,89 @@
+#pragma once
+
+#include <atomic>
+
+#include "utils.hpp"
+
+namespace mole {
+
+// Free list of sessions, one per io_context. It is only touched from the thread running
+// that context, so it needs no locking. Released sessions are reset() and handed out again,
+// which keeps malloc/free and the construction of their buffers off the accept path.
+// Registered as an asio service so it is torn down together with the context.
+template<typename Session>
+class session_pool: public asio::execution_context::service {
+public:
+    using key_type = session_pool<Session>;
+    inline static asio::execution_context::id id;
+
+    explicit session_pool(asio::io_context& ctx):
+        asio::execution_context::service{ctx}, ctx_{ctx}, shutdown_{false} {
+    }
+
+    ~session_pool() override {
+        _clear();
+    }
+
+    session_pool(const session_pool&) = delete;
+    session_pool(session_pool&&) = delete;
+
+    static std::shared_ptr<Session> acquire(asio::io_context& ctx) {
+        return asio::use_service<session_pool>(ctx)._acquire();
+    }
+
+    // sessions kept idle in the pools of all contexts, for benchmarks; counts sizeof(Session)
+    // only, not what a reset session may still own on the heap
+    static size_t idle_bytes() {
+        return idle_.load(std::memory_order_relaxed) * sizeof(Session);
+    }
+
+private:
+    void shutdown() override {
+        // handlers destroyed after this point delete their sessions directly
+        shutdown_ = true;
+        _clear();
+    }
+
+    std::shared_ptr<Session> _acquire() {
+        Session *sess;
+        if (free_.empty()) {
+            sess = new Session(ctx_);
+        } else {
+            sess = free_.back();
+            free_.pop_back();
+            idle_.fetch_sub(1, std::memory_order_relaxed);
+        }
+        return std::shared_ptr<Session>(sess, [this](Session *s) {
+            _release(s);
+        });
+    }
+
+    void _release(Session *sess) {
+        if (shutdown_ || free_.size() >= MAX_IDLE) {
+            delete sess;
+            return;
+        }
+        sess->reset();
+        free_.push_back(sess);
+        idle_.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    void _clear() {
+        for (auto *sess: free_) {
+            delete sess;
+        }
+        idle_.fetch_sub(free_.size(), std::memory_order_relaxed);
+        free_.clear();
+    }
+
+private:
+    static constexpr size_t MAX_IDLE = 1024;
+
+    inline static std::atomic<size_t> idle_{0};
+
+    asio::io_context& ctx_;
+    bool shutdown_;
+    std::vector<Session*> free_;
+};
+
+}
@@ -1,6 +1,9 @@
 #pragma once
 
+#include <thread>
+
 #include "mole_crypto.hpp"
+#include "session_pool.hpp"
 #include "utils.hpp"
 
 namespace mole {
@@ -10,44 +13,154 @@ using asio::ip::tcp;
 template<typename Session>
 class tcp_srv {
 public:
-    explicit tcp_srv(uint16_t port) :
-        conn_ctx_{},
+    explicit tcp_srv(uint16_t port, size_t threads = 1, bool pin = false, bool reuse_port = false) :
+        workers_{},
         accept_ctx_{},
-        acceptor_{accept_ctx_, tcp::endpoint{tcp::v4(), port}},
-        con_guard_{asio::make_work_guard(conn_ctx_)} {
+        acceptor_{accept_ctx_},
+        pin_{pin},
+        reuse_port_{reuse_port},
+        next_{0} {
+        threads = std::max<size_t>(threads, 1);
+        for (size_t i = 0; i < threads; ++i) {
+            workers_.emplace_back(std::make_unique<worker>());
+        }
+
+        if (reuse_port_) {
+            // shared-nothing: one listener per worker, the kernel balances new connections
+            for (auto& w: workers_) {
+                w->acceptor = std::make_unique<tcp::acceptor>(w->ctx);
+                _listen(*w->acceptor, port);
+                port = w->acceptor->local_endpoint().port();
+            }
+        } else {
+            _listen(acceptor_, port);
+        }
     }
 
     tcp_srv(const tcp_srv &) = delete;
 
     tcp_srv(tcp_srv &&) = delete;
 
-    ~tcp_srv() = default;
+    ~tcp_srv() {
+        stop();
+        _join();
+    }
 
     tcp_srv &operator=(const tcp_srv &) = delete;
 
     tcp_srv &operator=(tcp_srv &&) = delete;
 
+    uint16_t port() const {
+        if (reuse_port_) {
+            return workers_.front()->acceptor->local_endpoint().port();
+        }
+        return acceptor_.local_endpoint().port();
+    }
+
     void run() {
-        std::thread([this]() {
-            conn_ctx_.run();
-        }).detach();
-
-        spdlog::info("listen at {}", acceptor_.local_endpoint().port());
-        acceptor_.set_option(tcp::acceptor::reuse_address(true));
-        _accept();
-        accept_ctx_.run();
+        start();
+        _join();
+    }
+
+    void start() {
+        for (size_t i = 0; i < workers_.size(); ++i) {
+            auto& w = *workers_[i];
+            if (w.acceptor) {
+                _accept(w);
+            }
+            w.thread = std::thread([this, &w, i]() {
+                if (pin_ && !pin_thread(i)) {
+                    spdlog::warn("pin thread {} failed", i);
+                }
+                w.ctx.run();
+            });
+        }
+
+        spdlog::info("listen at {}, threads: {}, reuse_port: {}", port(), workers_.size(), reuse_port_);
+        if (!reuse_port_) {
+            _accept();
+            accept_thread_ = std::thread([this]() {
+                accept_ctx_.run();
+            });
+        }
+    }
+
+    // may be called from any thread, run() returns once every context has stopped
+    void stop() {
+        accept_ctx_.stop();
+        for (auto& w: workers_) {
+            w->ctx.stop();
+        }
     }
 
 private:
+    using executor_work_guard_t = asio::executor_work_guard<asio::io_context::executor_type>;
+    using reuse_port_t = asio::detail::socket_option::boolean<SOL_SOCKET, SO_REUSEPORT>;
+
+    struct worker {
+        asio::io_context ctx{1};
+        executor_work_guard_t guard{asio::make_work_guard(ctx)};
+        std::unique_ptr<tcp::acceptor> acceptor;
+        std::thread thread;
+    };
+
+    void _listen(tcp::acceptor& acceptor, uint16_t port) {
+        // dual stack, IPv4 clients arrive as v4-mapped; IPv4 only where the host has no IPv6
+        tcp::endpoint ep{tcp::v6(), port};
+        std::error_code ec;
+        acceptor.open(ep.protocol(), ec);
+        if (!ec) {
+            acceptor.set_option(asio::ip::v6_only(false), ec);
+        }
+        if (ec) {
+            if (acceptor.is_open()) {
+                acceptor.close();
+            }
+            ep = {tcp::v4(), port};
+            acceptor.open(ep.protocol());
+        }
+        acceptor.set_option(tcp::acceptor::reuse_address(true));
+        if (reuse_port_) {
+            acceptor.set_option(reuse_port_t(true));
+        }
+        acceptor.bind(ep);
+        acceptor.listen();
+    }
+
+    void _join() {
+        if (accept_thread_.joinable()) {
+            accept_thread_.join();
+        }
+        for (auto& w: workers_) {
+            if (w->thread.joinable()) {
+                w->thread.join();
+            }
+        }
+    }
+
+    worker& _next_worker() {
+        // round-robin, sessions never migrate so they need no locking
+        auto& w = *workers_[next_];
+        next_ = (next_ + 1) % workers_.size();
+        return w;
+    }
+
     void _accept() {
-        auto sess = std::make_shared<Session>(conn_ctx_);
-        acceptor_.async_accept(sess->socket(), [this, sess](const std::error_code &ec) {
+        auto& ctx = _next_worker().ctx;
+        acceptor_.async_accept(ctx, [this, &ctx](const std::error_code &ec, tcp::socket peer) {
+            if (ec == asio::error::operation_aborted) {
+                return;
+            }
             if (ec) {
                 spdlog::error("async_accept error:{}", ec.message());
             } else {
-                const auto &ep = sess->socket().remote_endpoint();
+                std::error_code ep_ec;
+                const auto &ep = peer.remote_endpoint(ep_ec);
                 spdlog::debug("accept from {}:{}", ep.address().to_string(), ep.port());
-                conn_ctx_.post([sess]() {
+                // the session pool belongs to ctx, so take the session on its thread
+                asio::post(ctx, [&ctx, peer = std::move(peer)]() mutable {
+                    auto sess = session_pool<Session>::acquire(ctx);
+                    sess->socket() = std::move(peer);
                     sess->start();
                 });
             }
@@ -55,13 +168,33 @@ private:
         });
     }
 
-private:
-    using executor_work_guard_t = asio::executor_work_guard<asio::io_context::executor_type>;
+    void _accept(worker& w) {
+        auto sess = session_pool<Session>::acquire(w.ctx);
+        w.acceptor->async_accept(sess->socket(), [this, &w, sess](const std::error_code &ec) {
+            if (ec == asio::error::operation_aborted) {
+                return;
+            }
+            if (ec) {
+                spdlog::error("async_accept error:{}", ec.message());
+            } else {
+                std::error_code ep_ec;
+                const auto &ep = sess->socket().remote_endpoint(ep_ec);
+                spdlog::debug("accept from {}:{}", ep.address().to_string(), ep.port());
+                sess->start();
+            }
+            _accept(w);
+        });
+    }
 
-    asio::io_context conn_ctx_;
+private:
+    // declared first so pending accepts are destroyed before the worker contexts
+    std::vector<std::unique_ptr<worker>> workers_;
     asio::io_context accept_ctx_;
     tcp::acceptor acceptor_;
-    executor_work_guard_t con_guard_;
+    std::thread accept_thread_;
+    bool pin_;
+    bool reuse_port_;
+    size_t next_;
 };
 
 
@@ -0,0 +1,127 @@
+#include "timer_wheel.hpp"
+
+namespace mole {
+
+timer_wheel::timer_wheel(asio::io_context& ctx):
+    asio::execution_context::service{ctx}, origin_{clock::now()}, timer_{ctx},
+    ticking_{false}, shutdown_{false}, now_{0}, size_{0}, slots_(SLOTS, nullptr), expiring_{nullptr} {
+}
+
+void timer_wheel::shutdown() {
+    // sessions outlive the wheel while the context is torn down, leave them unlinked
+    shutdown_ = true;
+    ticking_ = false;
+    timer_.cancel();
+    for (size_t slot = 0; slot < SLOTS; ++slot) {
+        while (auto *e = slots_[slot]) {
+            unlink(*e);
+        }
+    }
+    while (auto *e = expiring_) {
+        unlink(*e);
+    }
+}
+
+uint64_t timer_wheel::elapsed() const {
+    return static_cast<uint64_t>((clock::now() - origin_) / TICK);
+}
+
+void timer_wheel::arm(entry& e, clock::duration timeout) {
+    if (shutdown_) {
+        return;
+    }
+    if (!ticking_) {
+        // idle wheels do not tick, catch up with the clock first
+        now_ = elapsed();
+    }
+    auto ticks = std::max<uint64_t>(static_cast<uint64_t>((timeout + TICK - clock::duration{1}) / TICK), 1);
+    auto deadline = now_ + ticks;
+    if (e.slot_ != NONE && deadline >= e.deadline_) {
+        // later than before, moved on when its slot expires
+        e.deadline_ = deadline;
+        return;
+    }
+    if (e.slot_ != NONE) {
+        unlink(e);
+    }
+    e.deadline_ = deadline;
+    link(e, deadline % SLOTS);
+    if (!ticking_) {
+        ticking_ = true;
+        timer_.expires_at(origin_ + static_cast<clock::duration::rep>(now_ + 1) * TICK);
+        tick();
+    }
+}
+
+void timer_wheel::link(entry& e, size_t slot) {
+    auto& h = head(slot);
+    e.prev_ = nullptr;
+    e.next_ = h;
+    if (h != nullptr) {
+        h->prev_ = &e;
+    }
+    h = &e;
+    e.slot_ = slot;
+    ++size_;
+}
+
+void timer_wheel::unlink(entry& e) {
+    if (e.prev_ != nullptr) {
+        e.prev_->next_ = e.next_;
+    } else {
+        head(e.slot_) = e.next_;
+    }
+    if (e.next_ != nullptr) {
+        e.next_->prev_ = e.prev_;
+    }
+    e.prev_ = nullptr;
+    e.next_ = nullptr;
+    e.slot_ = NONE;
+    --size_;
+}
+
+void timer_wheel::tick() {
+    timer_.async_wait([this](const std::error_code& ec) {
+        if (ec || shutdown_) {
+            return;
+        }
+        advance();
+        if (size_ == 0) {
+            ticking_ = false;
+            return;
+        }
+        timer_.expires_at(timer_.expiry() + TICK);
+        tick();
+    });
+}
+
+void timer_wheel::advance() {
+    auto target = elapsed();
+    while (now_ < target && size_ > 0) {
+        expire(++now_);
+    }
+    now_ = std::max(now_, target);
+}
+
+void timer_wheel::expire(uint64_t now) {
+    auto slot = now % SLOTS;
+    if (slots_[slot] == nullptr) {
+        return;
+    }
+    // take the whole slot first, callbacks may arm or cancel entries meanwhile
+    expiring_ = slots_[slot];
+    slots_[slot] = nullptr;
+    for (auto *e = expiring_; e != nullptr; e = e->next_) {
+        e->slot_ = EXPIRING;
+    }
+    while (auto *e = expiring_) {
+        unlink(*e);
+        if (e->deadline_ > now) {
+            link(*e, e->deadline_ % SLOTS);
+            continue;
+        }
+        e->on_expire_();
+    }
+}
+
+}
@@ -0,0 +1,101 @@
+#pragma once
+
+#include "utils.hpp"
+
+namespace mole {
+
+// Coarse timeouts for many sessions, one hashed wheel per io_context. Arming is O(1) and
+// pushing a deadline later, as every read of an idle timeout does, only stores it: the entry
+// stays in its slot and is moved on when that slot comes round. One steady_timer per context
+// ticks while anything is armed. Only touched from the thread running the context, and
+// registered as an asio service like session_pool.
+class timer_wheel: public asio::execution_context::service {
+public:
+    using key_type = timer_wheel;
+    inline static asio::execution_context::id id;
+
+    using clock = std::chrono::steady_clock;
+    static constexpr clock::duration TICK = std::chrono::milliseconds(100);
+
+    // a timeout owned by a session, on_expire runs on the context thread
+    class entry {
+    public:
+        entry(timer_wheel& wheel, std::function<void()> on_expire):
+            wheel_{wheel}, on_expire_{std::move(on_expire)} {
+        }
+
+        ~entry() {
+            cancel();
+        }
+
+        entry(const entry&) = delete;
+        entry(entry&&) = delete;
+
+        // (re)starts the timeout, an unarmed or expired entry is armed again
+        void arm(clock::duration timeout) {
+            wheel_.arm(*this, timeout);
+        }
+
+        void cancel() {
+            if (slot_ != NONE) {
+                wheel_.unlink(*this);
+            }
+        }
+
+        bool armed() const {
+            return slot_ != NONE;
+        }
+
+    private:
+        friend class timer_wheel;
+
+        timer_wheel& wheel_;
+        std::function<void()> on_expire_;
+        entry *prev_ = nullptr;
+        entry *next_ = nullptr;
+        uint64_t deadline_ = 0;
+        size_t slot_ = NONE;
+    };
+
+    explicit timer_wheel(asio::io_context& ctx);
+    ~timer_wheel() override = default;
+
+    timer_wheel(const timer_wheel&) = delete;
+    timer_wheel(timer_wheel&&) = delete;
+
+    static timer_wheel& of(asio::io_context& ctx) {
+        return asio::use_service<timer_wheel>(ctx);
+    }
+
+private:
+    static constexpr size_t SLOTS = 512;
+    static constexpr size_t NONE = SIZE_MAX;
+    // entries of the slot being expired
+    static constexpr size_t EXPIRING = SIZE_MAX - 1;
+
+    void shutdown() override;
+
+    void arm(entry& e, clock::duration timeout);
+    void link(entry& e, size_t slot);
+    void unlink(entry& e);
+    entry*& head(size_t slot) {
+        return slot == EXPIRING ? expiring_ : slots_[slot];
+    }
+
+    uint64_t elapsed() const;
+    void tick();
+    void advance();
+    void expire(uint64_t now);
+
+    clock::time_point origin_;
+    asio::steady_timer timer_;
+    bool ticking_;
+    bool shutdown_;
+    // ticks since origin_ the wheel has expired up to
+    uint64_t now_;
+    size_t size_;
+    std::vector<entry*> slots_;
+    entry *expiring_;
+};
+
+}
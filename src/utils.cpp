@@ -1,3 +1,6 @@
+#include <pthread.h>
+#include <thread>
+
 #include "spdlog/sinks/stdout_color_sinks.h"
 
 #include "utils.hpp"
@@ -15,6 +18,19 @@ void logging_init(const char *name, bool dev) {
     spdlog::set_default_logger(logger);
 }
 
+bool pin_thread(size_t index) {
+#ifdef __linux__
+    auto n = std::max(std::thread::hardware_concurrency(), 1u);
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    CPU_SET(index % n, &cpus);
+    return pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus) == 0;
+#else
+    (void)index;
+    return false;
+#endif
+}
+
 std::vector<std::string> split(const std::string& ss, char c) {
     std::vector<std::string> rr;
     if (ss.empty()) {
@@ -23,7 +39,7 @@ std::vector<std::string> split(const std::string& ss, char c) {
     auto p = ss.find_first_not_of(c, 0);
     auto q = ss.find_first_of(c, p);
     while (p != std::string::npos || q != std::string::npos) {
-        rr.emplace_back(ss.substr(p, q));
+        rr.emplace_back(ss.substr(p, q == std::string::npos ? q : q - p));
         p = ss.find_first_not_of(c, q);
         q = ss.find_first_of(c, p);
     }
@@ -31,7 +47,10 @@ std::vector<std::string> split(const std::string& ss, char c) {
 }
 
 mole_cfg::mole_cfg():
-    port_{20903},dev_{false}
+    port_{20903},threads_{1},pin_{false},reuse_port_{false},ciphers_{0xff},max_frame_{1024 * 32},crypto_threads_{0},
+    connect_delay_{250},connect_timeout_{10000},handshake_timeout_{10},idle_timeout_{300},
+    dns_ttl_{60},dns_negative_ttl_{5},dns_min_ttl_{5},dns_max_ttl_{3600},
+    dns_stale_{30},dns_cache_size_{65536},dns_timeout_{1000},dns_attempts_{2},dev_{false}
     {}
 
 mole_cfg& mole_cfg::self() {
@@ -39,33 +58,4 @@ mole_cfg& mole_cfg::self() {
     return cfg;
 }
 
-
-constexpr int64_t CACHE_MILLIS = 1000 * 60;
-
-domain_cache & domain_cache::self() {
-    static domain_cache cache;
-    return cache;
-}
-
-void domain_cache::set(const std::string &domain, const endpoint_vector &endpoints) {
-    auto now = std::chrono::system_clock::now();
-    auto millis = std::chrono::duration_cast<std::chrono::milliseconds>(now.time_since_epoch()).count();
-    cache_[domain] = {endpoints, millis};
-}
-
-domain_cache::endpoint_vector domain_cache::get(const std::string &domain) {
-    auto it = cache_.find(domain);
-    if (it == cache_.end()) {
-        return {};
-    }
-    auto now = std::chrono::system_clock::now();
-    auto millis = std::chrono::duration_cast<std::chrono::milliseconds>(now.time_since_epoch()).count();
-    if (it->second.ts + CACHE_MILLIS < millis) {
-        cache_.erase(it);
-        return {};
-    }
-    return it->second.endpoints;
-}
-
-
 }
@@ -1,6 +1,7 @@
 #pragma once
 
 #include <map>
+#include <mutex>
 
 #define ASIO_STANDALONE
 #include "asio.hpp"
@@ -44,6 +45,8 @@ namespace mole {
 
 void logging_init(const char *name, bool dev = false);
 
+bool pin_thread(size_t index);
+
 std::vector<std::string> split(const std::string& ss, char c);
 inline std::vector<std::string> split(const std::string& ss) {
     return split(ss, ' ');
@@ -56,33 +59,51 @@ struct mole_cfg {
     mole_cfg(mole_cfg&&) = delete;
 
     __declare_ref__(std::string, key)
+    __declare_ref__(std::string, users)
+    // blinds the key id hint of the hellos, the same on the remote and all its locals
+    __declare_ref__(std::string, hint_key)
+    // local: rules file of router
+    __declare_ref__(std::string, rules)
     __declare_ref__(asio::ip::tcp::endpoint, remote_endpoint)
+    // remote: resolve with dns_resolver through these instead of getaddrinfo
+    __declare_ref__(std::vector<asio::ip::udp::endpoint>, nameservers)
+    // remote: domain_cache is loaded from and saved to it
+    __declare_ref__(std::string, dns_cache_file)
 
     __declare_val__(uint16_t, port)
+    __declare_val__(size_t, threads)
+    __declare_val__(bool, pin)
+    __declare_val__(bool, reuse_port)
+    // bitmask of mole_crypto::cipher allowed for data frames
+    __declare_val__(uint8_t, ciphers)
+    // largest frame payload offered or accepted in the hello
+    __declare_val__(size_t, max_frame)
+    // crypto_pool workers, 0 keeps all AEAD work on the connection threads
+    __declare_val__(size_t, crypto_threads)
+    // remote: Happy Eyeballs delay between target connect attempts and timeout of each, in ms
+    __declare_val__(size_t, connect_delay)
+    __declare_val__(size_t, connect_timeout)
+    // seconds a session may take for its handshake, and stay without traffic once streaming; 0 is none
+    __declare_val__(size_t, handshake_timeout)
+    __declare_val__(size_t, idle_timeout)
+    // remote: seconds names are kept that come without a record TTL (getaddrinfo, literals,
+    // localhost), and names that did not resolve
+    __declare_val__(size_t, dns_ttl)
+    __declare_val__(size_t, dns_negative_ttl)
+    // remote: bounds of the record TTLs taken from the nameservers
+    __declare_val__(size_t, dns_min_ttl)
+    __declare_val__(size_t, dns_max_ttl)
+    // remote: seconds an expired name is still served while it is resolved again
+    __declare_val__(size_t, dns_stale)
+    // remote: names kept by domain_cache at most
+    __declare_val__(size_t, dns_cache_size)
+    // dns_resolver: ms to wait for an answer, and rounds over the nameservers
+    __declare_val__(size_t, dns_timeout)
+    __declare_val__(size_t, dns_attempts)
     __declare_val__(bool, dev)
 
 private:
     explicit mole_cfg();
 };
 
-
-struct domain_cache {
-    static domain_cache& self();
-
-    using endpoint_vector = std::vector<asio::ip::tcp::endpoint>;
-    void set(const std::string& domain, const endpoint_vector& endpoints);
-    endpoint_vector get(const std::string& domain);
-
-private:
-    domain_cache() = default;
-
-    struct item {
-        std::vector<asio::ip::tcp::endpoint> endpoints;
-        int64_t ts;
-        item() = default;
-        item(const endpoint_vector& v, int64_t t):endpoints{v},ts{t}{}
-    };
-    std::map<std::string, item> cache_;
-};
-
 }
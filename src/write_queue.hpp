@@ -0,0 +1,57 @@
+#pragma once
+
+#include <array>
+#include <deque>
+
+#include "buffer_pool.hpp"
+#include "utils.hpp"
+
+namespace mole {
+
+// borrowed buffer holding `size` bytes at `offset` queued for writing, not ready while
+// crypto_pool still works on it
+struct pending_write {
+    buffer_pool::buffer data;
+    size_t offset;
+    size_t size;
+    bool ready = true;
+
+    asio::const_buffer buffer() const {
+        return asio::buffer(data.get() + offset, size);
+    }
+};
+
+// decrypted frame living in a frame_reader, queued for writing
+struct pending_frame {
+    const uint8_t *data;
+    size_t size;
+    uint64_t end;
+    bool ready = true;
+
+    asio::const_buffer buffer() const {
+        return asio::buffer(data, size);
+    }
+};
+
+// chunks at the front that can be written, the rest waits so the order is kept
+template<typename T>
+size_t ready_count(const std::deque<T>& queue) {
+    size_t n = 0;
+    while (n < queue.size() && queue[n].ready) {
+        ++n;
+    }
+    return n;
+}
+
+// the first n (at most N) queued chunks as one buffer sequence, so they go out in a single
+// gather write; unused slots stay empty and are skipped
+template<size_t N, typename T>
+std::array<asio::const_buffer, N> gather(const std::deque<T>& queue, size_t n) {
+    std::array<asio::const_buffer, N> bb;
+    for (size_t i = 0; i < n; ++i) {
+        bb[i] = queue[i].buffer();
+    }
+    return bb;
+}
+
+}